@@ -7,8 +7,9 @@
 
 namespace Algorithms {
 
-	std::vector<int> BresenhamLine(int x0, int y0, int x1, int y1, int width, int height) {
-		std::vector<int> pixels;
+	// Walks the Bresenham line and calls visit(index) for every in-bounds pixel.
+	template <typename Visitor>
+	void TraceLine(int x0, int y0, int x1, int y1, int width, int height, Visitor&& visit) {
 		int dx = std::abs(x1 - x0);
 		int dy = std::abs(y1 - y0);
 		int sx = (x0 < x1) ? 1 : -1;
@@ -18,7 +19,7 @@ namespace Algorithms {
 
 		while (true) {
 			if (x >= 0 && x < width && y >= 0 && y < height) {
-				pixels.push_back(y * width + x);
+				visit(y * width + x);
 			}
 
 			if (x == x1 && y == y1) break;
@@ -27,10 +28,20 @@ namespace Algorithms {
 			if (e2 > -dy) { err -= dy; x += sx; }
 			if (e2 < dx) { err += dx; y += sy; }
 		}
+	}
 
+	std::vector<int> BresenhamLine(int x0, int y0, int x1, int y1, int width, int height) {
+		std::vector<int> pixels;
+		TraceLine(x0, y0, x1, y1, width, height, [&](int idx) { pixels.push_back(idx); });
 		return pixels;
 	}
 
+	int CountLinePixels(int x0, int y0, int x1, int y1, int width, int height) {
+		int count = 0;
+		TraceLine(x0, y0, x1, y1, width, height, [&](int) { count++; });
+		return count;
+	}
+
 	double CalculateMSE(const Image& target, const Image& rendered) {
 		if (target.getWidth() != rendered.getWidth() || target.getHeight() != rendered.getHeight()) {
 			return 0.0;
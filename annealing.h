@@ -0,0 +1,413 @@
+#pragma once
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include "image.h"
+#include "models.h"
+#include "algorithms.h"
+#include "services.h"
+#include "sequence_energy.h"
+
+// One sample of an annealing run, taken every params.annealTraceInterval
+// moves. acceptanceRate covers the moves since the previous sample.
+struct AnnealingTracePoint {
+    long long moves = 0;
+    double temperature = 0.0;
+    double energy = 0.0;
+    double bestEnergy = 0.0;
+    double acceptanceRate = 0.0;
+};
+
+struct AnnealingStats {
+    long long moves = 0;
+    long long accepted = 0;
+    long long invalid = 0; // moves that would create a line closer than minGap
+    long long screenMisses = 0; // passed on per-line deltas, rejected on the exact delta
+    long long proposedByType[5] = {};
+    long long acceptedByType[5] = {};
+    double energyBefore = 0.0;
+    double energyAfter = 0.0;
+    double startTemperature = 0.0; // as used, after calibration
+    double endTemperature = 0.0;
+    long timeMs = 0;
+    bool continuous = true; // false: the input was not one path and was returned unchanged
+    std::vector<AnnealingTracePoint> trace;
+
+    double AcceptanceRate() const { return moves > 0 ? (double)accepted / moves : 0.0; }
+    double MovesPerSecond() const { return timeMs > 0 ? moves * 1000.0 / timeMs : 0.0; }
+};
+
+// Simulated annealing over a finished thread path. Every move keeps the
+// path continuous and is scored with SequenceEnergy over the pixels of the
+// few lines it removes and adds:
+//   Reroute  a-b-c becomes a-m-c for a random nail m
+//   Reverse  a-[x..y]-b becomes a-[y..x]-b; the lines inside are the same
+//            chords, so only the two boundary lines change
+//   Remove   a-b-c becomes a-c
+//   Insert   a-c becomes a-m-c
+//   Splice   a-[x..y]-b ... c-d becomes a-b ... c-[x..y]-d (or-opt); the
+//            segment moves with its inner lines, three lines change
+// Move types are drawn with the params.anneal*Weight weights. Only lines
+// drawn with params.lineAlpha are removed or added; lines of other alphas
+// stay as they are, see SequenceEnergy.
+//
+// A move that raises the energy by d is accepted with probability
+// exp(-d / T), where T (in MSE units) goes from the start to the end
+// temperature over the time or move budget, whichever runs out first. A
+// start temperature left at 0 is calibrated on a sample of random moves, so
+// that a share annealStartAcceptance of them would be accepted; an end
+// temperature left at 0 is the start temperature times annealCoolingRatio.
+//
+// Moves are first screened with the sum of SequenceEnergy::LineDelta over
+// their lines, a lookup per pixel, and only moves that pass are scored
+// exactly. A move is never accepted on the screen alone, but when its lines
+// share pixels the sum can overestimate the exact delta, and such a move may
+// be rejected although the exact delta would have passed.
+//
+// The run is sequential and reproducible for a fixed annealSeed and move
+// budget. The best path seen at a trace sample or at the end is returned.
+class SimulatedAnnealing {
+public:
+    enum MoveType { Reroute = 0, Reverse = 1, Remove = 2, Insert = 3, Splice = 4 };
+
+private:
+    // Random moves drawn to calibrate a temperature left at 0.
+    static constexpr int kCalibrationMoves = 2000;
+
+    struct Move {
+        int type = Reroute;
+        int i = 0;
+        int j = 0;
+        int k = 0;
+        int nail = -1;
+        bool valid = false;
+        int lines[6][3]; // (from, to, sign) of the lines removed and added
+        int lineCount = 0;
+
+        void line(int from, int to, int sign) {
+            if (from < 0 || to < 0) return;
+            lines[lineCount][0] = from;
+            lines[lineCount][1] = to;
+            lines[lineCount][2] = sign;
+            lineCount++;
+        }
+    };
+
+    const LinePalette* palette;
+
+    // Temperature at which a move of the sample is accepted with the given
+    // mean probability, found by bisection on a log scale.
+    static double calibrate(const std::vector<double>& deltas, double acceptance) {
+        if (deltas.empty()) return 0.0;
+        acceptance = std::min(0.999, std::max(1e-6, acceptance));
+        auto acceptedAt = [&](double t) {
+            double sum = 0.0;
+            for (double d : deltas) sum += d > 0.0 ? std::exp(-d / t) : 1.0;
+            return sum / deltas.size();
+        };
+        double lo = 1e-9, hi = 1e9;
+        if (acceptedAt(lo) >= acceptance) return lo;
+        for (int i = 0; i < 100; i++) {
+            double mid = std::sqrt(lo * hi);
+            (acceptedAt(mid) < acceptance ? lo : hi) = mid;
+        }
+        return hi;
+    }
+
+    double temperatureAt(double t0, double t1, AnnealingSchedule schedule, double progress) const {
+        if (schedule == AnnealingSchedule::Linear || t0 <= 0.0 || t1 <= 0.0) {
+            return t0 + (t1 - t0) * progress;
+        }
+        return t0 * std::pow(t1 / t0, progress);
+    }
+
+    // Draws a random move of the given type. A move is invalid if it would
+    // create a line closer than minGap, touch a line that is not counted or
+    // grow the path past maxNodes.
+    template <typename Rng>
+    Move drawMove(Rng& rng, int type, const SequenceEnergy& energy, const std::vector<int>& path,
+                  const std::vector<double>& alphas, int maxNodes, int maxSegment, int minGap) const {
+        auto pick = [&](int n) { return (int)(rng() % (std::uint64_t)n); };
+        auto counted = [&](int line) { return energy.IsCounted(alphas, line); };
+        int nailCount = palette->GetNailCount();
+        int n = (int)path.size();
+        Move move;
+        move.type = type;
+
+        if (type == Reroute) {
+            int i = move.i = pick(n);
+            int nail = move.nail = pick(nailCount);
+            int prev = i > 0 ? path[i - 1] : -1;
+            int next = i + 1 < n ? path[i + 1] : -1;
+            move.valid = nail != path[i]
+                && (prev < 0 || (counted(i - 1) && palette->IsEligible(prev, nail, minGap)))
+                && (next < 0 || (counted(i) && palette->IsEligible(nail, next, minGap)));
+            move.line(prev, path[i], -1);
+            move.line(path[i], next, -1);
+            move.line(prev, nail, +1);
+            move.line(nail, next, +1);
+        } else if (type == Reverse) {
+            // Reverses path[i..j]; at an end of the path only one boundary
+            // line changes.
+            int i = move.i = pick(n);
+            int j = move.j = std::min(n - 1, i + 1 + pick(maxSegment));
+            int prev = i > 0 ? path[i - 1] : -1;
+            int next = j + 1 < n ? path[j + 1] : -1;
+            move.valid = j > i && (prev >= 0 || next >= 0)
+                && (prev < 0 || (counted(i - 1) && palette->IsEligible(prev, path[j], minGap)))
+                && (next < 0 || (counted(j) && palette->IsEligible(path[i], next, minGap)));
+            move.line(prev, path[i], -1);
+            move.line(path[j], next, -1);
+            move.line(prev, path[j], +1);
+            move.line(path[i], next, +1);
+        } else if (type == Remove) {
+            int i = move.i = pick(n);
+            int prev = i > 0 ? path[i - 1] : -1;
+            int next = i + 1 < n ? path[i + 1] : -1;
+            move.valid = n > 2 && (prev < 0 || counted(i - 1)) && (next < 0 || counted(i))
+                && (prev < 0 || next < 0 || palette->IsEligible(prev, next, minGap));
+            move.line(prev, path[i], -1);
+            move.line(path[i], next, -1);
+            if (prev >= 0 && next >= 0) move.line(prev, next, +1);
+        } else if (type == Splice) {
+            // Moves the inner segment path[i..j] between path[k - 1] and
+            // path[k], somewhere outside it.
+            if (n < 4) return move;
+            int i = move.i = 1 + pick(n - 2);
+            int j = move.j = std::min(n - 2, i + pick(maxSegment));
+            int k = move.k = 1 + pick(n - 1);
+            if (k >= i && k <= j + 1) return move;
+            int a = path[i - 1], b = path[j + 1], c = path[k - 1], d = path[k];
+            move.valid = counted(i - 1) && counted(j) && counted(k - 1)
+                && palette->IsEligible(a, b, minGap)
+                && palette->IsEligible(c, path[i], minGap)
+                && palette->IsEligible(path[j], d, minGap);
+            move.line(a, path[i], -1);
+            move.line(path[j], b, -1);
+            move.line(c, d, -1);
+            move.line(a, b, +1);
+            move.line(c, path[i], +1);
+            move.line(path[j], d, +1);
+        } else {
+            // Inserts before path[i]; i == n appends to the end.
+            int i = move.i = pick(n + 1);
+            int nail = move.nail = pick(nailCount);
+            int prev = i > 0 ? path[i - 1] : -1;
+            int next = i < n ? path[i] : -1;
+            move.valid = n < maxNodes && (prev < 0 || next < 0 || counted(i - 1))
+                && (prev < 0 || palette->IsEligible(prev, nail, minGap))
+                && (next < 0 || palette->IsEligible(nail, next, minGap));
+            if (prev >= 0 && next >= 0) move.line(prev, next, -1);
+            move.line(prev, nail, +1);
+            move.line(nail, next, +1);
+        }
+        return move;
+    }
+
+    // Applies an accepted move to the path and, if kept, the line alphas.
+    void applyMove(const Move& move, std::vector<int>& path, std::vector<double>& alphas, double lineAlpha) const {
+        int n = (int)path.size();
+        if (move.type == Reroute) {
+            path[move.i] = move.nail;
+        } else if (move.type == Reverse) {
+            std::reverse(path.begin() + move.i, path.begin() + move.j + 1);
+            if (!alphas.empty()) std::reverse(alphas.begin() + move.i, alphas.begin() + move.j);
+        } else if (move.type == Splice) {
+            // The three boundary lines are counted before and after, so only
+            // the blocks of lines between them swap places.
+            int i = move.i, j = move.j, k = move.k;
+            if (k > j) {
+                std::rotate(path.begin() + i, path.begin() + j + 1, path.begin() + k);
+                if (!alphas.empty()) {
+                    std::rotate(alphas.begin() + i, alphas.begin() + j, alphas.begin() + k - 1);
+                    std::rotate(alphas.begin() + i, alphas.begin() + i + 1, alphas.begin() + i + k - 1 - j);
+                }
+            } else {
+                std::rotate(path.begin() + k, path.begin() + i, path.begin() + j + 1);
+                if (!alphas.empty()) {
+                    std::rotate(alphas.begin() + k, alphas.begin() + i, alphas.begin() + j);
+                    std::rotate(alphas.begin() + k + j - i, alphas.begin() + j - 1, alphas.begin() + j);
+                }
+            }
+        } else if (move.type == Remove) {
+            // The two lines at the node become one; both were counted.
+            if (!alphas.empty()) alphas.erase(alphas.begin() + (move.i + 1 < n ? move.i : move.i - 1));
+            path.erase(path.begin() + move.i);
+        } else {
+            if (!alphas.empty()) alphas.insert(alphas.begin() + (move.i == n ? n - 1 : move.i), lineAlpha);
+            path.insert(path.begin() + move.i, move.nail);
+        }
+    }
+
+public:
+    explicit SimulatedAnnealing(const LinePalette* palette) : palette(palette) {}
+
+    // Anneals input.lineSequence under the hit-count model with
+    // params.lineAlpha, keeping input.lineAlphas. Runs for at most
+    // params.annealTimeMs milliseconds and params.annealMoves moves; 0
+    // leaves that budget open, at least one of them must be set. A sequence
+    // that is not one continuous path is returned unchanged.
+    GenerationResult Anneal(const Image& target, const GenerationResult& input,
+                            const GenerationParameters& params, AnnealingStats* stats = nullptr) {
+        auto start = std::chrono::high_resolution_clock::now();
+        AnnealingStats local;
+        int minGap = params.minGap;
+
+        std::vector<int> path = SequenceEnergy::ToPath(input.lineSequence);
+        if (path.empty()) {
+            local.continuous = input.lineSequence.empty();
+            if (stats) *stats = local;
+            return input;
+        }
+        std::vector<double> alphas = input.lineAlphas;
+        if (!alphas.empty() && alphas.size() + 1 != path.size()) alphas.clear();
+
+        SequenceEnergy energy(target, palette, params.lineAlpha);
+        energy.Load(path, alphas);
+        local.energyBefore = energy.GetEnergy();
+        double scale = energy.Scale();
+
+        std::vector<int> best = path;
+        std::vector<double> bestAlphas = alphas;
+        double bestEnergy = local.energyBefore;
+
+        double weights[5] = { params.annealRerouteWeight, params.annealReverseWeight,
+                              params.annealRemoveWeight, params.annealInsertWeight, params.annealSpliceWeight };
+        double totalWeight = 0.0;
+        for (double& w : weights) totalWeight += (w = std::max(0.0, w));
+        bool budgeted = params.annealTimeMs > 0 || params.annealMoves > 0;
+
+        if (path.size() > 2 && totalWeight > 0.0 && budgeted) {
+            std::mt19937_64 rng(params.annealSeed);
+            std::uniform_real_distribution<double> unit(0.0, 1.0);
+            auto drawType = [&]() {
+                double r = unit(rng) * totalWeight;
+                int type = 0;
+                while (type < 4 && r >= weights[type]) r -= weights[type++];
+                return type;
+            };
+
+            SequenceEnergy::Change change = energy.MakeChange();
+            int maxNodes = (int)path.size();
+            int maxSegment = std::max(2, params.annealMaxSegment);
+            LineScratch scratch;
+
+            double t0 = params.annealStartTemperature;
+            double t1 = params.annealEndTemperature;
+            if (t0 <= 0.0) {
+                std::vector<double> deltas;
+                for (int s = 0; s < kCalibrationMoves; s++) {
+                    Move move = drawMove(rng, drawType(), energy, path, alphas, maxNodes, maxSegment, minGap);
+                    if (!move.valid) continue;
+                    for (int l = 0; l < move.lineCount; l++) {
+                        energy.Pending(change, move.lines[l][0], move.lines[l][1], move.lines[l][2], scratch);
+                    }
+                    deltas.push_back(change.delta * scale);
+                    energy.Discard(change);
+                }
+                t0 = calibrate(deltas, params.annealStartAcceptance);
+            }
+            if (t1 <= 0.0) t1 = t0 * params.annealCoolingRatio;
+            local.startTemperature = t0;
+            local.endTemperature = t1;
+
+            energy.TrackLineDeltas();
+            long long traceInterval = std::max(1, params.annealTraceInterval);
+            long long acceptedAtSample = 0;
+            double temperature = t0;
+
+            for (;;) {
+                // The clock and the temperature are only updated every 1024
+                // moves; reading the clock costs about as much as a move.
+                if ((local.moves & 1023) == 0) {
+                    double progress = 0.0;
+                    if (params.annealTimeMs > 0) {
+                        double elapsed = (double)std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::high_resolution_clock::now() - start).count();
+                        progress = elapsed / params.annealTimeMs;
+                    }
+                    if (params.annealMoves > 0) {
+                        progress = std::max(progress, (double)local.moves / params.annealMoves);
+                    }
+                    if (progress >= 1.0) break;
+                    temperature = temperatureAt(t0, t1, params.annealSchedule, progress);
+                }
+                if (params.annealMoves > 0 && local.moves >= params.annealMoves) break;
+
+                if (local.moves > 0 && local.moves % traceInterval == 0) {
+                    AnnealingTracePoint point;
+                    point.moves = local.moves;
+                    point.temperature = temperature;
+                    point.energy = energy.GetEnergy();
+                    if (point.energy < bestEnergy) {
+                        bestEnergy = point.energy;
+                        best = path;
+                        bestAlphas = alphas;
+                    }
+                    point.bestEnergy = bestEnergy;
+                    point.acceptanceRate = (double)(local.accepted - acceptedAtSample) / traceInterval;
+                    acceptedAtSample = local.accepted;
+                    local.trace.push_back(point);
+                }
+                local.moves++;
+
+                int type = drawType();
+                local.proposedByType[type]++;
+                Move move = drawMove(rng, type, energy, path, alphas, maxNodes, maxSegment, minGap);
+                if (!move.valid) {
+                    local.invalid++;
+                    continue;
+                }
+
+                // Screen with the per-line deltas, then confirm the moves
+                // that pass with the exact delta against the same threshold.
+                double limit = temperature > 0.0 ? -temperature * std::log(1.0 - unit(rng)) : 0.0;
+                double screened = 0.0;
+                for (int l = 0; l < move.lineCount; l++) {
+                    screened += energy.LineDelta(move.lines[l][0], move.lines[l][1], move.lines[l][2], scratch);
+                }
+                if (screened * scale > limit) continue;
+
+                for (int l = 0; l < move.lineCount; l++) {
+                    energy.Pending(change, move.lines[l][0], move.lines[l][1], move.lines[l][2], scratch);
+                }
+                if (change.delta * scale > limit) {
+                    energy.Discard(change);
+                    local.screenMisses++;
+                    continue;
+                }
+
+                energy.Apply(change);
+                local.accepted++;
+                local.acceptedByType[type]++;
+                applyMove(move, path, alphas, params.lineAlpha);
+            }
+        }
+
+        if (energy.GetEnergy() > bestEnergy) {
+            path = best;
+            alphas = bestAlphas;
+            energy.Load(path, alphas);
+        }
+
+        GenerationResult result;
+        result.nails = input.nails;
+        result.lineSequence = SequenceEnergy::ToSequence(path);
+        result.lineAlphas = std::move(alphas);
+        Image intensity = energy.Render();
+        auto end = std::chrono::high_resolution_clock::now();
+        local.energyAfter = energy.GetEnergy();
+        local.timeMs = (long)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+
+        result.metrics.setMse(Algorithms::CalculateMSE(target, intensity));
+        result.metrics.setRmse(Algorithms::CalculateRMSE(target, intensity));
+        result.metrics.setCoveragePercent(Algorithms::CalculateCoveragePercent(intensity));
+        result.metrics.setTotalLines(result.lineSequence.size());
+        result.metrics.setProcessingTimeMs(local.timeMs);
+        result.renderedImage = std::move(intensity);
+        if (stats) *stats = std::move(local);
+        return result;
+    }
+};
@@ -0,0 +1,233 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include "image.h"
+#include "models.h"
+#include "algorithms.h"
+#include "scoring.h"
+#include "thread_pool.h"
+#include "services.h"
+
+// Per-pixel hit counts split into fixed-size pages. Copies share pages and
+// a page is cloned only when a copy first writes to it, so a child state
+// costs one page table plus the pages its line touches.
+class PagedHits {
+private:
+    static constexpr int kPageBits = 12;
+    static constexpr int kPageSize = 1 << kPageBits;
+
+    std::vector<std::shared_ptr<std::vector<unsigned char>>> pages;
+
+public:
+    PagedHits() = default;
+
+    PagedHits(const unsigned char* hits, int pixelCount) {
+        for (int first = 0; first < pixelCount; first += kPageSize) {
+            auto page = std::make_shared<std::vector<unsigned char>>(kPageSize, 0);
+            std::copy(hits + first, hits + std::min(pixelCount, first + kPageSize), page->begin());
+            pages.push_back(std::move(page));
+        }
+    }
+
+    int Get(int idx) const { return (*pages[idx >> kPageBits])[idx & (kPageSize - 1)]; }
+
+    void Increment(int idx, int maxHits) {
+        auto& page = pages[idx >> kPageBits];
+        if (page.use_count() > 1) page = std::make_shared<std::vector<unsigned char>>(*page);
+        unsigned char& hits = (*page)[idx & (kPageSize - 1)];
+        if (hits < maxHits) hits++;
+    }
+};
+
+// Keeps the beamWidth best partial sequences instead of one. Each step
+// scores every line from every beam's current nail, spread over all workers
+// in (beam, nail range) chunks, keeps each beam's beamWidth best lines and
+// continues with the beamWidth expansions of lowest total error. Beams
+// only share the immutable LinePalette and the hit-count tables; their own
+// state is a PagedHits and a line chain whose prefix is shared with the
+// parent beam.
+//
+// Scores use the hit-count model (see HitCountScorer), whatever
+// params.intensityModel says. A beam stops growing when none of its lines
+// gains more than params.improvementThreshold; the result is the beam with
+// the lowest error seen.
+class BeamSearchOptimizer {
+private:
+    struct BeamLine {
+        int from;
+        int to;
+        std::shared_ptr<const BeamLine> parent;
+    };
+
+    struct Beam {
+        PagedHits hits;
+        int current = 0;
+        int length = 0;
+        double error = 0.0; // squared error summed over pixels
+        std::shared_ptr<const BeamLine> last;
+    };
+
+    struct Expansion {
+        double gain;
+        int beam;
+        int nail;
+    };
+
+    const LinePalette* palette;
+    ReusableThreadPool pool;
+    std::vector<LineScratch> workerScratch;
+
+    // Keeps the count best expansions, highest gain first and the lower nail
+    // on ties, so the result does not depend on how candidates were split.
+    static void keepBest(std::vector<Expansion>& out, size_t count) {
+        size_t keep = std::min(out.size(), count);
+        std::partial_sort(out.begin(), out.begin() + keep, out.end(), [](const Expansion& a, const Expansion& c) {
+            return a.gain != c.gain ? a.gain > c.gain : a.nail < c.nail;
+        });
+        out.resize(keep);
+    }
+
+public:
+    explicit BeamSearchOptimizer(const LinePalette* palette) : palette(palette) {}
+
+    GenerationResult Optimize(const Image& target,
+                              const GenerationParameters& params,
+                              const OptimizerState& initial = OptimizerState(),
+                              void (*progress)(int, int, const char*) = nullptr) {
+        auto startTime = std::chrono::high_resolution_clock::now();
+        int nailCount = palette->GetNailCount();
+        int pixelCount = target.getSize();
+        int width = std::max(1, params.beamWidth);
+        int threads = pool.Get(params.threads).GetThreadCount();
+        workerScratch.resize(threads);
+
+        HitCountScorer tables(target, params.lineAlpha, params.simdLevel);
+        if (initial.intensity.getSize() == pixelCount) tables.Reset(initial.intensity);
+        int maxHits = tables.GetMaxHits();
+        double thresholdRaw = params.improvementThreshold * pixelCount;
+
+        Beam root;
+        root.hits = PagedHits(tables.GetHits().data(), pixelCount);
+        root.current = initial.currentNail;
+        const auto& targetValues = target.getData();
+        for (int i = 0; i < pixelCount; i++) {
+            double diff = targetValues[i] - (255.0 - tables.GetLevel(root.hits.Get(i)) * 255.0);
+            root.error += diff * diff;
+        }
+
+        std::vector<Beam> beams{ root };
+        Beam best = root;
+        std::vector<std::vector<Expansion>> chunks;
+        std::vector<std::vector<Expansion>> perBeam;
+        std::vector<Expansion> merged;
+
+        for (int step = 0; step < params.maxIterations && !beams.empty(); step++) {
+            // Every beam's candidates are split into ranges so all workers
+            // have work even when there are fewer beams than threads; each
+            // range keeps its best width lines, then each beam keeps the
+            // best width of its ranges' survivors.
+            int beamCount = (int)beams.size();
+            int ranges = std::max(1, std::min(nailCount, (2 * threads + beamCount - 1) / beamCount));
+            chunks.assign((size_t)beamCount * ranges, std::vector<Expansion>());
+            pool->ParallelForEach(beamCount * ranges, [&](int chunk, int worker) {
+                int b = chunk / ranges;
+                int r = chunk % ranges;
+                const Beam& beam = beams[b];
+                auto& out = chunks[chunk];
+                int begin = (int)((long long)nailCount * r / ranges);
+                int end = (int)((long long)nailCount * (r + 1) / ranges);
+                for (int cand = begin; cand < end; cand++) {
+                    if (!palette->IsEligible(beam.current, cand, params.minGap)) continue;
+                    double gain = 0.0;
+                    for (int idx : palette->GetLine(beam.current, cand, workerScratch[worker])) {
+                        gain += tables.GainAt(idx, beam.hits.Get(idx));
+                    }
+                    if (gain > thresholdRaw) out.push_back({ gain, b, cand });
+                }
+                keepBest(out, width);
+            });
+
+            perBeam.assign(beamCount, std::vector<Expansion>());
+            for (int b = 0; b < beamCount; b++) {
+                auto& out = perBeam[b];
+                for (int r = 0; r < ranges; r++) {
+                    const auto& chunk = chunks[(size_t)b * ranges + r];
+                    out.insert(out.end(), chunk.begin(), chunk.end());
+                }
+                keepBest(out, width);
+            }
+
+            // Lowest resulting error first; ties keep the earlier beam and
+            // the lower nail so runs are reproducible.
+            merged.clear();
+            for (const auto& out : perBeam) merged.insert(merged.end(), out.begin(), out.end());
+            std::sort(merged.begin(), merged.end(), [&](const Expansion& a, const Expansion& c) {
+                double ea = beams[a.beam].error - a.gain;
+                double ec = beams[c.beam].error - c.gain;
+                if (ea != ec) return ea < ec;
+                return a.beam != c.beam ? a.beam < c.beam : a.nail < c.nail;
+            });
+
+            // The same lines drawn in a different order give the same error
+            // and end nail; keep only the first of such duplicates.
+            std::vector<Expansion> chosen;
+            for (const auto& e : merged) {
+                if ((int)chosen.size() == width) break;
+                double error = beams[e.beam].error - e.gain;
+                bool duplicate = false;
+                for (const auto& c : chosen) {
+                    if (c.nail == e.nail && beams[c.beam].error - c.gain == error) duplicate = true;
+                }
+                if (!duplicate) chosen.push_back(e);
+            }
+            if (chosen.empty()) break;
+
+            std::vector<Beam> next(chosen.size());
+            pool->ParallelForEach((int)chosen.size(), [&](int i, int worker) {
+                const Expansion& e = chosen[i];
+                const Beam& parent = beams[e.beam];
+                Beam& child = next[i];
+                child.hits = parent.hits;
+                for (int idx : palette->GetLine(parent.current, e.nail, workerScratch[worker])) {
+                    child.hits.Increment(idx, maxHits);
+                }
+                child.current = e.nail;
+                child.length = parent.length + 1;
+                child.error = parent.error - e.gain;
+                child.last = std::make_shared<const BeamLine>(BeamLine{ parent.current, e.nail, parent.last });
+            });
+
+            beams = std::move(next);
+            if (beams[0].error < best.error) best = beams[0];
+
+            if (progress && step % 100 == 0) {
+                progress(step, params.maxIterations, "Beam search...");
+            }
+        }
+
+        GenerationResult result;
+        result.nails = palette->GetNails();
+        result.lineSequence = initial.lineSequence;
+        std::vector<const BeamLine*> chain;
+        for (const BeamLine* line = best.last.get(); line; line = line->parent.get()) chain.push_back(line);
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            result.lineSequence.emplace_back((*it)->from, (*it)->to, result.lineSequence.size());
+        }
+
+        Image intensity(target.getWidth(), target.getHeight());
+        auto& values = intensity.getData();
+        for (int i = 0; i < pixelCount; i++) values[i] = tables.GetLevel(best.hits.Get(i));
+
+        auto endTime = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
+        result.metrics.setMse(Algorithms::CalculateMSE(target, intensity));
+        result.metrics.setRmse(Algorithms::CalculateRMSE(target, intensity));
+        result.metrics.setCoveragePercent(Algorithms::CalculateCoveragePercent(intensity));
+        result.metrics.setTotalLines(result.lineSequence.size());
+        result.metrics.setProcessingTimeMs(duration.count());
+        result.renderedImage = std::move(intensity);
+        return result;
+    }
+};
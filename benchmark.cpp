@@ -0,0 +1,104 @@
+#include <iostream>
+#include <iomanip>
+#include <filesystem>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include "image.h"
+#include "models.h"
+#include "algorithms.h"
+#include "services.h"
+#include "beam_search.h"
+#include "image_processor.h"
+
+namespace fs = std::filesystem;
+
+// Greedy against beam search on the same palette and hit-count model.
+// Greedy runs with growing line budgets, so for every beam run the table
+// also shows the best MSE greedy reached in the same wall-clock time.
+struct BenchmarkRow {
+    std::string method;
+    int lines;
+    long timeMs;
+    double mse;
+};
+
+static void PrintRow(const BenchmarkRow& row, double initialMse) {
+    double seconds = std::max(row.timeMs, 1L) / 1000.0;
+    std::cout << std::left << std::setw(14) << row.method << std::right
+              << std::setw(8) << row.lines
+              << std::setw(10) << row.timeMs
+              << std::setw(14) << std::fixed << std::setprecision(4) << row.mse
+              << std::setw(16) << std::setprecision(1) << (initialMse - row.mse) / seconds << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::cout << "=== String Art Benchmark: greedy vs beam search ===" << std::endl << std::endl;
+
+    if (argc < 2) {
+        std::cout << "Usage: benchmark <image_path> [resolution] [lines]" << std::endl;
+        std::cout << "Example: benchmark photo.png 360 2000" << std::endl;
+        return 1;
+    }
+
+    std::string imagePath = argv[1];
+    if (!fs::exists(imagePath)) {
+        std::cerr << "ERROR: Image not found: " << imagePath << std::endl;
+        return 1;
+    }
+
+    GenerationParameters params;
+    if (argc > 2) params.imageResolution = std::atoi(argv[2]);
+    int lines = (argc > 3) ? std::atoi(argv[3]) : 2000;
+    params.intensityModel = IntensityModel::HitCount;
+    params.maxIterations = lines;
+
+    ImageProcessor imgProc;
+    Image target = imgProc.LoadAndProcess(imagePath, params.imageResolution);
+    LinePalette palette(params.nailCount, params.imageResolution, params.imageResolution,
+                        params.paletteCacheDirectory, params.threads);
+    double initialMse = Algorithms::CalculateMSE(target, Image(params.imageResolution, params.imageResolution));
+
+    std::cout << "Resolution: " << params.imageResolution << "x" << params.imageResolution << std::endl;
+    std::cout << "Nails: " << params.nailCount << std::endl;
+    std::cout << "Line budget: " << lines << std::endl;
+    std::cout << "Initial MSE: " << std::fixed << std::setprecision(4) << initialMse << std::endl << std::endl;
+
+    std::cout << std::left << std::setw(14) << "method" << std::right << std::setw(8) << "lines"
+              << std::setw(10) << "ms" << std::setw(14) << "MSE" << std::setw(16) << "MSE gain/s" << std::endl;
+
+    // Greedy with the normal stop threshold, then run longer without it.
+    std::vector<BenchmarkRow> greedyRows;
+    GreedyOptimizer greedy(&palette);
+    for (int budget : { lines / 2, lines, lines * 2, lines * 4 }) {
+        GenerationParameters run = params;
+        run.maxIterations = budget;
+        if (budget > lines) run.improvementThreshold = 0.0;
+        GenerationResult result = greedy.Optimize(target, palette.GetNails(), run);
+        BenchmarkRow row{ "greedy", (int)result.lineSequence.size(), result.metrics.getProcessingTimeMs(),
+                          result.metrics.getMse() };
+        greedyRows.push_back(row);
+        PrintRow(row, initialMse);
+    }
+
+    BeamSearchOptimizer beam(&palette);
+    for (int width : { 2, 4, 8 }) {
+        GenerationParameters run = params;
+        run.beamWidth = width;
+        GenerationResult result = beam.Optimize(target, run);
+        BenchmarkRow row{ "beam B=" + std::to_string(width), (int)result.lineSequence.size(),
+                          result.metrics.getProcessingTimeMs(), result.metrics.getMse() };
+        PrintRow(row, initialMse);
+
+        const BenchmarkRow* sameTime = nullptr;
+        for (const auto& g : greedyRows) {
+            if (g.timeMs <= row.timeMs && (!sameTime || g.mse < sameTime->mse)) sameTime = &g;
+        }
+        if (sameTime) {
+            std::cout << "  greedy within " << row.timeMs << "ms: MSE " << std::setprecision(4) << sameTime->mse
+                      << (row.mse < sameTime->mse ? " (beam better)" : " (greedy better)") << std::endl;
+        }
+    }
+
+    return 0;
+}
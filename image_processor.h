@@ -4,6 +4,8 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <charconv>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -73,8 +75,21 @@ public:
             file << "\n";
         }
 
-        file << " ]\n";
-        file << "}\n";
+        file << " ]";
+
+        // Stages may draw with different alphas; shortest round-trip form so
+        // a replay uses exactly the alpha the optimizer did.
+        if (!result.lineAlphas.empty()) {
+            file << ",\n \"line_alphas\": [";
+            char buffer[32];
+            for (size_t i = 0; i < result.lineAlphas.size(); i++) {
+                auto res = std::to_chars(buffer, buffer + sizeof(buffer), result.lineAlphas[i]);
+                file << (i > 0 ? "," : "") << std::string_view(buffer, res.ptr - buffer);
+            }
+            file << "]";
+        }
+
+        file << "\n}\n";
         file.close();
     }
 
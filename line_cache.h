@@ -0,0 +1,172 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+#include "models.h"
+
+struct LineCacheStats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;
+    std::int64_t pixels = 0;     // pixel entries of the cached lines
+    std::int64_t bytes = 0;      // cached lines including per-entry overhead
+    std::int64_t indexBytes = 0; // key -> slot table
+    std::int64_t budgetBytes = 0;
+
+    double HitRate() const {
+        std::uint64_t total = hits + misses;
+        return total ? (double)hits / total : 0.0;
+    }
+};
+
+// Memory-bounded cache of rasterized lines keyed by pair index. Keys are
+// spread over independently locked shards so optimizer threads rarely
+// contend, and each shard evicts with the CLOCK (second chance) policy once
+// it exceeds its share of the budget. A flat key -> slot table replaces a
+// hash lookup.
+//
+// Cached lines are immutable and shared: a hit hands out a pin to the line
+// instead of copying it, so a line evicted by another thread stays alive
+// until the last caller reading it drops its pin.
+class LineCache {
+private:
+    using Pin = std::shared_ptr<const std::vector<int>>;
+
+    struct Entry {
+        std::int64_t key = -1;
+        Pin pixels;
+        bool referenced = false;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::vector<Entry> entries;
+        std::vector<std::int32_t> freeSlots;
+        size_t hand = 0;
+        size_t used = 0;
+        std::int64_t pixels = 0;
+        std::int64_t bytes = 0;
+    };
+
+    static constexpr std::int64_t kEntryOverhead = 64;
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<std::int32_t> slotOf; // per key, slot in its shard or -1; guarded by that shard
+    std::int64_t budgetBytes;
+    std::int64_t shardBudget;
+    std::atomic<std::uint64_t> hits{ 0 };
+    std::atomic<std::uint64_t> misses{ 0 };
+    std::atomic<std::uint64_t> evictions{ 0 };
+
+    static std::int64_t entryBytes(size_t pixelCount) {
+        return (std::int64_t)(pixelCount * sizeof(int)) + kEntryOverhead;
+    }
+
+    Shard& shardOf(std::int64_t key) { return *shards[(size_t)key % shards.size()]; }
+
+    void evictOne(Shard& shard) {
+        while (true) {
+            if (shard.hand >= shard.entries.size()) shard.hand = 0;
+            Entry& entry = shard.entries[shard.hand++];
+            if (entry.key < 0) continue;
+            if (entry.referenced) {
+                entry.referenced = false;
+                continue;
+            }
+
+            shard.pixels -= (std::int64_t)entry.pixels->size();
+            shard.bytes -= entryBytes(entry.pixels->size());
+            shard.used--;
+            slotOf[entry.key] = -1;
+            shard.freeSlots.push_back((std::int32_t)(shard.hand - 1));
+            entry.key = -1;
+            entry.pixels.reset();
+            evictions++;
+            return;
+        }
+    }
+
+    void insert(Shard& shard, std::int64_t key, const Pin& line) {
+        std::int64_t need = entryBytes(line->size());
+        if (need > shardBudget) return;
+        while (shard.bytes + need > shardBudget && shard.used > 0) {
+            evictOne(shard);
+        }
+
+        std::int32_t slot;
+        if (!shard.freeSlots.empty()) {
+            slot = shard.freeSlots.back();
+            shard.freeSlots.pop_back();
+        } else {
+            slot = (std::int32_t)shard.entries.size();
+            shard.entries.emplace_back();
+        }
+
+        Entry& entry = shard.entries[slot];
+        entry.key = key;
+        entry.pixels = line;
+        entry.referenced = true;
+        slotOf[key] = slot;
+        shard.used++;
+        shard.pixels += (std::int64_t)line->size();
+        shard.bytes += need;
+    }
+
+public:
+    // keyCount bounds the keys: every key is in [0, keyCount).
+    LineCache(std::int64_t budgetBytes, std::int64_t keyCount, int shardCount = 16)
+        : slotOf((size_t)keyCount, -1), budgetBytes(budgetBytes) {
+        shardCount = std::max(1, shardCount);
+        shardBudget = std::max<std::int64_t>(1, budgetBytes / shardCount);
+        for (int i = 0; i < shardCount; i++) {
+            shards.push_back(std::make_unique<Shard>());
+        }
+    }
+
+    // Returns the cached line for key and pins it in pin, or rasterizes it
+    // with rasterize(scratch) outside the shard lock, caches a copy and
+    // returns the scratch. The span stays valid while pin and scratch are
+    // left alone.
+    template <typename Rasterize>
+    LineSpan Get(std::int64_t key, Pin& pin, std::vector<int>& scratch, Rasterize&& rasterize) {
+        Shard& shard = shardOf(key);
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            std::int32_t slot = slotOf[key];
+            if (slot >= 0) {
+                Entry& entry = shard.entries[slot];
+                entry.referenced = true;
+                pin = entry.pixels;
+                hits++;
+                return LineSpan(pin->data(), pin->data() + pin->size());
+            }
+        }
+
+        misses++;
+        pin.reset();
+        rasterize(scratch);
+        Pin line = std::make_shared<const std::vector<int>>(scratch);
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (slotOf[key] < 0) insert(shard, key, line);
+        return LineSpan(scratch.data(), scratch.data() + scratch.size());
+    }
+
+    LineCacheStats GetStats() const {
+        LineCacheStats stats;
+        stats.hits = hits;
+        stats.misses = misses;
+        stats.evictions = evictions;
+        stats.budgetBytes = budgetBytes;
+        stats.indexBytes = (std::int64_t)(slotOf.size() * sizeof(std::int32_t));
+        for (const auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            stats.pixels += shard->pixels;
+            stats.bytes += shard->bytes;
+        }
+        return stats;
+    }
+};
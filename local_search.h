@@ -0,0 +1,246 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include "image.h"
+#include "models.h"
+#include "algorithms.h"
+#include "thread_pool.h"
+#include "services.h"
+#include "sequence_energy.h"
+
+struct LocalSearchStats {
+    int rounds = 0;
+    long long proposals = 0;
+    long long removals = 0;
+    long long reroutes = 0;
+    long long rejected = 0; // proposals that no longer improved when applied
+    double energyBefore = 0.0;
+    double energyAfter = 0.0;
+    long timeMs = 0;
+    bool continuous = true; // false: the input was not one path and was returned unchanged
+};
+
+// Post-pass over a finished thread path. Two moves keep the path
+// continuous: removing nail i (a-b-c becomes a-c) and rerouting it to the
+// best other nail (a-b-c becomes a-m-c); at either end of the path they drop
+// or move the end line. Moves are scored with SequenceEnergy over the
+// pixels of the lines they remove and add. Only nodes whose lines were all
+// drawn with params.lineAlpha move; lines of other alphas stay where they
+// are, see SequenceEnergy.
+//
+// Each round has three phases, one per node index mod 3. Nodes of one phase
+// are three apart, so their moves share no line and no end nail, and they
+// all propose their best move in parallel against the same state. The
+// proposals are then re-scored and applied one by one from the end of the
+// path, so removals never shift a pending index. A phase visits its nodes
+// in shuffled order, in tasks of params.refineWindow nodes, so a deadline
+// cuts the search short evenly along the whole path instead of after its
+// head. Stops when a round changes nothing or the time budget runs out.
+//
+// Reroute candidates are screened with SequenceEnergy::LineDelta, and only
+// those that pass are scored exactly; like annealing's screen this can miss
+// a candidate whose new lines share pixels with the removed ones.
+class LocalSearch {
+private:
+    enum class MoveType { Remove, Reroute };
+
+    struct Move {
+        int node = -1;
+        MoveType type = MoveType::Remove;
+        int nail = -1;
+        double delta = 0.0;
+    };
+
+    const LinePalette* palette;
+    ReusableThreadPool pool;
+
+    // Node i may move only if the lines on both sides of it are counted.
+    static bool isMovable(const SequenceEnergy& energy, const std::vector<double>& alphas, int i, int n) {
+        return (i == 0 || energy.IsCounted(alphas, i - 1)) && (i + 1 == n || energy.IsCounted(alphas, i));
+    }
+
+    // Stages the removal of the lines at node i and, unless nail < 0, the
+    // lines through nail in their place. Returns false if the move would
+    // create a line that is not allowed or node i may not move.
+    bool stage(const SequenceEnergy& energy, SequenceEnergy::Change& change, const std::vector<int>& path,
+               const std::vector<double>& alphas, int i, MoveType type, int nail, int minGap,
+               LineScratch& scratch) const {
+        int n = (int)path.size();
+        if (!isMovable(energy, alphas, i, n)) return false;
+        int prev = i > 0 ? path[i - 1] : -1;
+        int next = i + 1 < n ? path[i + 1] : -1;
+
+        if (type == MoveType::Remove) {
+            if (prev >= 0 && next >= 0 && !palette->IsEligible(prev, next, minGap)) return false;
+            if (prev >= 0) energy.Pending(change, prev, path[i], -1, scratch);
+            if (next >= 0) energy.Pending(change, path[i], next, -1, scratch);
+            if (prev >= 0 && next >= 0) energy.Pending(change, prev, next, +1, scratch);
+            return true;
+        }
+
+        if (nail == path[i]) return false;
+        if (prev >= 0 && !palette->IsEligible(prev, nail, minGap)) return false;
+        if (next >= 0 && !palette->IsEligible(nail, next, minGap)) return false;
+        if (prev >= 0) energy.Pending(change, prev, path[i], -1, scratch);
+        if (next >= 0) energy.Pending(change, path[i], next, -1, scratch);
+        if (prev >= 0) energy.Pending(change, prev, nail, +1, scratch);
+        if (next >= 0) energy.Pending(change, nail, next, +1, scratch);
+        return true;
+    }
+
+    // Best improving move of each of the count nodes, appended to moves.
+    // A reroute candidate whose screened delta beats the best so far is
+    // scored on top of the staged removal, adding and then taking back its
+    // two lines.
+    template <typename TimePoint>
+    void propose(const SequenceEnergy& energy, SequenceEnergy::Change& change, const std::vector<int>& path,
+                 const std::vector<double>& alphas, const int* nodes, int count, int minGap, LineScratch& scratch,
+                 TimePoint deadline, std::vector<Move>& moves) const {
+        int n = (int)path.size();
+        int nailCount = palette->GetNailCount();
+        for (int k = 0; k < count; k++) {
+            if (std::chrono::high_resolution_clock::now() > deadline) break;
+            int i = nodes[k];
+            if (!isMovable(energy, alphas, i, n)) continue;
+
+            Move best;
+            if (stage(energy, change, path, alphas, i, MoveType::Remove, -1, minGap, scratch)
+                && change.delta < best.delta) {
+                best = { i, MoveType::Remove, -1, change.delta };
+            }
+            energy.Discard(change);
+
+            int prev = i > 0 ? path[i - 1] : -1;
+            int next = i + 1 < n ? path[i + 1] : -1;
+            if (prev >= 0) energy.Pending(change, prev, path[i], -1, scratch);
+            if (next >= 0) energy.Pending(change, path[i], next, -1, scratch);
+            double removed = change.delta;
+            for (int m = 0; m < nailCount; m++) {
+                if (m == path[i]) continue;
+                if (prev >= 0 && !palette->IsEligible(prev, m, minGap)) continue;
+                if (next >= 0 && !palette->IsEligible(m, next, minGap)) continue;
+                double screened = removed;
+                if (prev >= 0) screened += energy.LineDelta(prev, m, +1, scratch);
+                if (next >= 0) screened += energy.LineDelta(m, next, +1, scratch);
+                if (screened >= best.delta) continue;
+                if (prev >= 0) energy.Pending(change, prev, m, +1, scratch);
+                if (next >= 0) energy.Pending(change, m, next, +1, scratch);
+                if (change.delta < best.delta) best = { i, MoveType::Reroute, m, change.delta };
+                if (next >= 0) energy.Pending(change, m, next, -1, scratch);
+                if (prev >= 0) energy.Pending(change, prev, m, -1, scratch);
+                change.delta = removed;
+            }
+            energy.Discard(change);
+            if (best.node >= 0) moves.push_back(best);
+        }
+    }
+
+public:
+    explicit LocalSearch(const LinePalette* palette) : palette(palette) {}
+
+    // Refines input.lineSequence under the hit-count model with
+    // params.lineAlpha, keeping input.lineAlphas. Runs for at most
+    // params.refineTimeMs milliseconds. A sequence that is not one
+    // continuous path is returned unchanged.
+    GenerationResult Refine(const Image& target, const GenerationResult& input,
+                            const GenerationParameters& params, LocalSearchStats* stats = nullptr) {
+        auto start = std::chrono::high_resolution_clock::now();
+        auto deadline = start + std::chrono::milliseconds(params.refineTimeMs);
+        LocalSearchStats local;
+
+        std::vector<int> path = SequenceEnergy::ToPath(input.lineSequence);
+        if (path.empty()) {
+            local.continuous = input.lineSequence.empty();
+            if (stats) *stats = local;
+            return input;
+        }
+        std::vector<double> alphas = input.lineAlphas;
+        if (!alphas.empty() && alphas.size() + 1 != path.size()) alphas.clear();
+
+        SequenceEnergy energy(target, palette, params.lineAlpha);
+        energy.Load(path, alphas);
+        energy.TrackLineDeltas();
+        local.energyBefore = energy.GetEnergy();
+
+        ThreadPool& workers = pool.Get(params.threads);
+        int threads = workers.GetThreadCount();
+        std::vector<SequenceEnergy::Change> changes;
+        for (int t = 0; t < threads; t++) changes.push_back(energy.MakeChange());
+        std::vector<LineScratch> scratch(threads);
+        SequenceEnergy::Change applyChange = energy.MakeChange();
+
+        int taskSize = std::max(4, params.refineWindow);
+        std::mt19937 rng;
+        std::vector<int> nodes;
+        std::vector<std::vector<Move>> proposals;
+        std::vector<Move> moves;
+        bool changed = true;
+        while (changed && path.size() > 2 && std::chrono::high_resolution_clock::now() < deadline) {
+            changed = false;
+            for (int phase = 0; phase < 3 && path.size() > 2; phase++) {
+                nodes.clear();
+                for (int i = phase; i < (int)path.size(); i += 3) nodes.push_back(i);
+                std::shuffle(nodes.begin(), nodes.end(), rng);
+
+                int tasks = ((int)nodes.size() + taskSize - 1) / taskSize;
+                proposals.assign(tasks, std::vector<Move>());
+                workers.ParallelForEach(tasks, [&](int task, int worker) {
+                    int begin = task * taskSize;
+                    int count = std::min((int)nodes.size() - begin, taskSize);
+                    propose(energy, changes[worker], path, alphas, nodes.data() + begin, count,
+                            params.minGap, scratch[worker], deadline, proposals[task]);
+                });
+
+                // Proposals share no line but may share pixels, so each move
+                // is re-scored against the path as it is by then.
+                moves.clear();
+                for (const auto& task : proposals) moves.insert(moves.end(), task.begin(), task.end());
+                std::sort(moves.begin(), moves.end(), [](const Move& a, const Move& b) { return a.node > b.node; });
+                for (const Move& move : moves) {
+                    local.proposals++;
+                    bool valid = stage(energy, applyChange, path, alphas, move.node, move.type, move.nail,
+                                       params.minGap, scratch[0]);
+                    if (!valid || applyChange.delta >= 0.0 || path.size() <= 2) {
+                        energy.Discard(applyChange);
+                        local.rejected++;
+                        continue;
+                    }
+                    energy.Apply(applyChange);
+                    if (move.type == MoveType::Remove) {
+                        // The two counted lines at the node become one.
+                        if (!alphas.empty()) {
+                            alphas.erase(alphas.begin() + (move.node + 1 < (int)path.size() ? move.node : move.node - 1));
+                        }
+                        path.erase(path.begin() + move.node);
+                        local.removals++;
+                    } else {
+                        path[move.node] = move.nail;
+                        local.reroutes++;
+                    }
+                    changed = true;
+                }
+            }
+            local.rounds++;
+        }
+
+        GenerationResult result;
+        result.nails = input.nails;
+        result.lineSequence = SequenceEnergy::ToSequence(path);
+        result.lineAlphas = std::move(alphas);
+        Image intensity = energy.Render();
+        auto end = std::chrono::high_resolution_clock::now();
+        local.energyAfter = energy.GetEnergy();
+        local.timeMs = (long)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+
+        result.metrics.setMse(Algorithms::CalculateMSE(target, intensity));
+        result.metrics.setRmse(Algorithms::CalculateRMSE(target, intensity));
+        result.metrics.setCoveragePercent(Algorithms::CalculateCoveragePercent(intensity));
+        result.metrics.setTotalLines(result.lineSequence.size());
+        result.metrics.setProcessingTimeMs(local.timeMs);
+        result.renderedImage = std::move(intensity);
+        if (stats) *stats = local;
+        return result;
+    }
+};
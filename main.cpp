@@ -2,11 +2,17 @@
 #include <filesystem>
 #include <iomanip>
 #include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
 #include "image.h"
 #include "models.h"
 #include "algorithms.h"
 #include "services.h"
 #include "image_processor.h"
+#include "schedule.h"
+#include "local_search.h"
+#include "annealing.h"
 
 namespace fs = std::filesystem;
 
@@ -18,14 +24,32 @@ void ReportProgress(int current, int total, const char* msg) {
 int main(int argc, char* argv[]) {
     std::cout << "=== String Art Generator v3.3 (C++) - Fast ===" << std::endl << std::endl;
 
-    if (argc < 2) {
-        std::cout << "Usage: StringArtGenerator [image_path] [output_dir]" << std::endl;
-        std::cout << "Example: StringArtGenerator photo.png output" << std::endl;
+    // Positional arguments, plus --option value pairs anywhere.
+    std::vector<std::string> positional;
+    std::vector<std::pair<std::string, std::string>> options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) == 0 && i + 1 < argc) options.emplace_back(arg, argv[++i]);
+        else positional.push_back(arg);
+    }
+
+    if (positional.empty()) {
+        std::cout << "Usage: StringArtGenerator [image_path] [output_dir] [schedule_file|pyramid] [options]" << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  --refine <ms>         local search after the schedule for up to ms milliseconds" << std::endl;
+        std::cout << "  --refine-window <n>   path nodes per parallel local-search task" << std::endl;
+        std::cout << "  --anneal <ms>         simulated annealing after the schedule for up to ms milliseconds" << std::endl;
+        std::cout << "  --anneal-moves <n>    stop annealing after n moves" << std::endl;
+        std::cout << "  --anneal-accept <p>   start where a share p of random moves is accepted" << std::endl;
+        std::cout << "  --anneal-t0 <t>       start temperature in MSE units, instead of calibrating" << std::endl;
+        std::cout << "  --anneal-t1 <t>       end temperature in MSE units" << std::endl;
+        std::cout << "Example: StringArtGenerator photo.png output stages.txt --refine 5000" << std::endl;
         return 1;
     }
 
-    std::string imagePath = argv[1];
-    std::string outputDir = (argc > 2) ? argv[2] : "StringArtResults";
+    std::string imagePath = positional[0];
+    std::string outputDir = (positional.size() > 1) ? positional[1] : "StringArtResults";
+    std::string schedulePath = (positional.size() > 2) ? positional[2] : "";
 
     if (!fs::exists(imagePath)) {
         std::cerr << "ERROR: Image not found: " << imagePath << std::endl;
@@ -33,100 +57,171 @@ int main(int argc, char* argv[]) {
     }
 
     try {
-        std::cout << "\n========== STAGE 1: COARSE STRUCTURE ==========" << std::endl;
-
-        GenerationParameters params1;
-        params1.imageResolution = 360;
-        params1.nailCount = 360;
-        params1.maxIterations = 500;
-        params1.lineAlpha = 0.05;
-        params1.stage = 1;
-        params1.exportJson = false;
-        params1.exportPng = false;
-        params1.inputImagePath = fs::absolute(imagePath).string();
-        params1.outputDirectory = fs::absolute(outputDir).string();
-
-        fs::create_directories(params1.outputDirectory);
-
-        std::cout << "Input: " << params1.inputImagePath << std::endl;
-        std::cout << "Output: " << params1.outputDirectory << std::endl;
-        std::cout << "Resolution: " << params1.imageResolution << "x" << params1.imageResolution << std::endl;
-        std::cout << "Nails: " << params1.nailCount << std::endl;
-        std::cout << "Max iterations (Stage 1): " << params1.maxIterations << std::endl;
-        std::cout << "Line Alpha (Stage 1): " << params1.lineAlpha << std::endl << std::endl;
-
-        ReportProgress(1, 4, "Loading image...");
+        GenerationParameters params;
+        params.imageResolution = 360;
+        params.nailCount = 360;
+        params.inputImagePath = fs::absolute(imagePath).string();
+        params.outputDirectory = fs::absolute(outputDir).string();
+        for (const auto& [name, value] : options) {
+            if (name == "--refine") params.refineTimeMs = std::stoi(value);
+            else if (name == "--refine-window") params.refineWindow = std::stoi(value);
+            else if (name == "--anneal") params.annealTimeMs = std::stoi(value);
+            else if (name == "--anneal-moves") params.annealMoves = std::stoll(value);
+            else if (name == "--anneal-accept") params.annealStartAcceptance = std::stod(value);
+            else if (name == "--anneal-t0") params.annealStartTemperature = std::stod(value);
+            else if (name == "--anneal-t1") params.annealEndTemperature = std::stod(value);
+            else {
+                std::cerr << "ERROR: Unknown option: " << name << std::endl;
+                return 1;
+            }
+        }
+
+        std::vector<StageSpec> schedule = Schedule::DefaultSchedule();
+        if (schedulePath == "pyramid") {
+            schedule = Schedule::Pyramid(params.imageResolution);
+        } else if (!schedulePath.empty()) {
+            std::string error;
+            if (!Schedule::Load(schedulePath, schedule, error)) {
+                std::cerr << "ERROR: " << error << std::endl;
+                return 1;
+            }
+        }
+
+        fs::create_directories(params.outputDirectory);
+
+        std::cout << "Input: " << params.inputImagePath << std::endl;
+        std::cout << "Output: " << params.outputDirectory << std::endl;
+        std::cout << "Resolution: " << params.imageResolution << "x" << params.imageResolution << std::endl;
+        std::cout << "Nails: " << params.nailCount << std::endl;
+        std::cout << "Schedule: " << (schedulePath.empty() ? "default" : schedulePath) << std::endl;
+        for (size_t s = 0; s < schedule.size(); s++) {
+            const StageSpec& spec = schedule[s];
+            std::cout << "  Stage " << s + 1 << " (" << spec.name << "): alpha " << spec.lineAlpha
+                      << ", gap " << spec.minGap << ", max " << spec.maxIterations << " lines, threshold "
+                      << spec.threshold << ", resolution "
+                      << (spec.resolution > 0 ? spec.resolution : params.imageResolution) << std::endl;
+        }
+        std::cout << std::endl;
+
         ImageProcessor imgProc;
-        Image targetMatrix = imgProc.LoadAndProcess(params1.inputImagePath, params1.imageResolution);
-
-        ReportProgress(2, 4, "Generating nails...");
-        Utils nailGen;
-        auto nails = nailGen.GenerateNails(
-            params1.nailCount,
-            params1.imageResolution / 2.0,
-            params1.imageResolution / 2.0,
-            params1.imageResolution / 2.0 - 5
-        );
-
-        ReportProgress(3, 4, "Optimizing (Stage 1)...");
-
-        LinePalette palette(nails.size(), params1.imageResolution, params1.imageResolution);
-        GreedyOptimizer optimizer(&palette);
-        auto result1 = optimizer.Optimize(targetMatrix, nails, params1, ReportProgress);
-
-        std::cout << "\n=== STAGE 1 RESULT ===" << std::endl;
-        std::cout << "Lines: " << result1.lineSequence.size() << std::endl;
-        std::cout << "MSE: " << std::fixed << std::setprecision(4) << result1.metrics.getMse() << std::endl;
-        std::cout << "RMSE: " << result1.metrics.getRmse() << std::endl;
-
-        std::cout << "\n========== STAGE 2: FINE TUNING ==========" << std::endl;
-
-        GenerationParameters params2;
-        params2.imageResolution = 360;
-        params2.nailCount = 360;
-        params2.maxIterations = 2000;
-        params2.lineAlpha = 0.1;
-        params2.stage = 2;
-        params2.exportJson = true;
-        params2.exportPng = true;
-        params2.inputImagePath = params1.inputImagePath;
-        params2.outputDirectory = params1.outputDirectory;
-
-        std::cout << "Max iterations (Stage 2): " << params2.maxIterations << std::endl;
-        std::cout << "Line Alpha (Stage 2): " << params2.lineAlpha << std::endl;
-        std::cout << "Threshold: 0.005 (balanced)" << std::endl << std::endl;
-
-        std::cout << "[050%] Optimizing (Stage 2)...\n";
-        auto result2 = optimizer.Optimize(targetMatrix, nails, params2, ReportProgress);
-
-        std::cout << "\n=== STAGE 2 RESULT ===" << std::endl;
-        std::cout << "Lines: " << result2.lineSequence.size() << std::endl;
-        std::cout << "MSE: " << result2.metrics.getMse() << std::endl;
-        std::cout << "RMSE: " << result2.metrics.getRmse() << std::endl;
+        StageRunner runner(params, [&](int resolution) {
+            return imgProc.LoadAndProcess(params.inputImagePath, resolution);
+        });
+
+        ReportProgress(1, 4, "Optimizing...");
+        GenerationResult result = runner.Run(schedule, ReportProgress, [](const StageReport& report) {
+            std::cout << "\n=== STAGE: " << report.spec.name << " ===" << std::endl;
+            std::cout << "Resolution: " << report.resolution << "x" << report.resolution << std::endl;
+            std::cout << "Lines: " << report.linesAdded << std::endl;
+            std::cout << "MSE: " << std::fixed << std::setprecision(4) << report.mse << std::endl;
+            std::cout << "RMSE: " << report.rmse << std::endl;
+            std::cout << "Full-res MSE: " << report.fullResMse << std::endl;
+            std::cout << "Time: " << report.timeMs << "ms (" << report.msPerMsePoint << " ms per MSE point)" << std::endl;
+            if (report.selection.skipped > 0) {
+                std::cout << "Scorings: " << std::setprecision(1) << report.selection.ScoredPerIteration()
+                          << " per iteration, " << report.selection.SkippedPerIteration() << " skipped ("
+                          << report.selection.SkipRate() * 100.0 << "%)"
+                          << std::setprecision(4) << std::endl;
+            }
+            if (report.selection.sweeps > 0) {
+                std::cout << "Sweeps: " << report.selection.sweeps << " (" << std::setprecision(2)
+                          << (double)report.linesAdded / report.selection.sweeps << " lines per sweep)"
+                          << std::setprecision(4) << std::endl;
+            }
+            if (report.screening.audits > 0) {
+                std::cout << "Screening audit: " << report.screening.audits << " checks, winner missed "
+                          << std::setprecision(1) << report.screening.MissRate() * 100.0 << "% (low-res top "
+                          << report.screening.LowResMissRate() * 100.0 << "%), MSE gain lost "
+                          << std::setprecision(4) << report.screening.improvementLost << std::endl;
+            }
+        });
+
+        long totalMs = result.metrics.getProcessingTimeMs();
+        int finalResolution = runner.GetReports().back().resolution;
+        const LinePalette* palette = runner.GetPalette(finalResolution);
+        if (palette->GetMode() == PaletteMode::OnDemand) {
+            LineCacheStats stats = palette->GetCacheStats();
+            std::cout << "Line cache: " << stats.hits << " hits, " << stats.misses << " misses ("
+                      << std::setprecision(1) << stats.HitRate() * 100.0 << "% hit rate), "
+                      << stats.evictions << " evictions, " << (stats.bytes >> 20) << " / "
+                      << (stats.budgetBytes >> 20) << " MB" << std::setprecision(4) << std::endl;
+        }
+
+        if (params.annealTimeMs > 0 || params.annealMoves > 0) {
+            std::cout << "\n========== ANNEALING ==========" << std::endl;
+            GenerationParameters annealParams = params;
+            annealParams.lineAlpha = schedule.back().lineAlpha;
+            annealParams.minGap = schedule.back().minGap;
+            AnnealingStats stats;
+            SimulatedAnnealing annealer(palette);
+            result = annealer.Anneal(*runner.GetTarget(finalResolution), result, annealParams, &stats);
+            totalMs += stats.timeMs;
+            if (!stats.continuous) std::cout << "Sequence is not one continuous path; left unchanged" << std::endl;
+            std::cout << "Temperature: " << stats.startTemperature << " -> " << stats.endTemperature << std::endl;
+            std::cout << "Moves: " << stats.moves << " (" << std::setprecision(0) << stats.MovesPerSecond()
+                      << "/s), accepted " << std::setprecision(2) << stats.AcceptanceRate() * 100.0
+                      << "%, invalid " << stats.invalid << ", screen misses " << stats.screenMisses << std::endl;
+            const char* moveNames[5] = { "reroute", "reverse", "remove", "insert", "splice" };
+            for (int t = 0; t < 5; t++) {
+                std::cout << "  " << moveNames[t] << ": " << stats.acceptedByType[t] << " / "
+                          << stats.proposedByType[t] << std::endl;
+            }
+            std::cout << std::setprecision(4);
+            for (const auto& point : stats.trace) {
+                std::cout << "  " << point.moves << " moves: T " << point.temperature << ", energy "
+                          << point.energy << ", best " << point.bestEnergy << ", accepted "
+                          << std::setprecision(2) << point.acceptanceRate * 100.0 << "%"
+                          << std::setprecision(4) << std::endl;
+            }
+            std::cout << "Energy: " << stats.energyBefore << " -> " << stats.energyAfter << std::endl;
+            std::cout << "Lines: " << result.lineSequence.size() << std::endl;
+            std::cout << "MSE: " << result.metrics.getMse() << std::endl;
+            std::cout << "Time: " << stats.timeMs << "ms" << std::endl;
+        }
+
+        if (params.refineTimeMs > 0) {
+            std::cout << "\n========== LOCAL SEARCH ==========" << std::endl;
+            GenerationParameters refineParams = params;
+            refineParams.lineAlpha = schedule.back().lineAlpha;
+            refineParams.minGap = schedule.back().minGap;
+            LocalSearchStats stats;
+            LocalSearch search(palette);
+            result = search.Refine(*runner.GetTarget(finalResolution), result, refineParams, &stats);
+            totalMs += stats.timeMs;
+            if (!stats.continuous) std::cout << "Sequence is not one continuous path; left unchanged" << std::endl;
+            std::cout << "Rounds: " << stats.rounds << ", removed " << stats.removals << ", rerouted "
+                      << stats.reroutes << ", rejected " << stats.rejected << std::endl;
+            std::cout << "Energy: " << stats.energyBefore << " -> " << stats.energyAfter << std::endl;
+            std::cout << "Lines: " << result.lineSequence.size() << std::endl;
+            std::cout << "MSE: " << result.metrics.getMse() << std::endl;
+            std::cout << "Time: " << stats.timeMs << "ms" << std::endl;
+        }
 
         std::cout << "\n========== EXPORTING ==========" << std::endl;
         std::cout << "[075%] Exporting...\n";
 
         Exporter exporter;
-        if (params2.exportJson) {
-            std::string jsonPath = params2.outputDirectory + "/result.json";
-            exporter.ExportJson(result2, jsonPath);
+        if (params.exportJson) {
+            std::string jsonPath = params.outputDirectory + "/result.json";
+            exporter.ExportJson(result, jsonPath);
             std::cout << "Saved: " << jsonPath << std::endl;
         }
 
-        if (params2.exportPng) {
-            std::string pngPath = params2.outputDirectory + "/result.png";
-            exporter.ExportPng(result2, pngPath, params2.imageResolution);
+        if (params.exportPng) {
+            std::string pngPath = params.outputDirectory + "/result.png";
+            exporter.ExportPng(result, pngPath, finalResolution);
             std::cout << "Saved: " << pngPath << std::endl;
         }
 
         std::cout << "\n=== FINAL RESULT ===" << std::endl;
-        std::cout << "Stage 1 Lines: " << result1.lineSequence.size() << std::endl;
-        std::cout << "Stage 2 Lines: " << result2.lineSequence.size() << std::endl;
-        std::cout << "MSE: " << std::fixed << std::setprecision(4) << result2.metrics.getMse() << std::endl;
-        std::cout << "RMSE: " << result2.metrics.getRmse() << std::endl;
-        std::cout << "Coverage: " << std::setprecision(2) << result2.metrics.getCoveragePercent() << "%" << std::endl;
-        std::cout << "Total Time: " << result2.metrics.getProcessingTimeMs() << "ms" << std::endl;
+        for (const auto& report : runner.GetReports()) {
+            std::cout << "Stage " << report.spec.name << " Lines: " << report.linesAdded << std::endl;
+        }
+        std::cout << "Total Lines: " << result.lineSequence.size() << std::endl;
+        std::cout << "MSE: " << std::fixed << std::setprecision(4) << result.metrics.getMse() << std::endl;
+        std::cout << "RMSE: " << result.metrics.getRmse() << std::endl;
+        std::cout << "Coverage: " << std::setprecision(2) << result.metrics.getCoveragePercent() << "%" << std::endl;
+        std::cout << "Total Time: " << totalMs << "ms" << std::endl;
 
         std::cout << "\n✓ Complete!" << std::endl;
 
@@ -0,0 +1,102 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file. Pages come from the OS page
+// cache, so processes mapping the same file share one copy.
+class MappedFile {
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        Close();
+    }
+
+    bool Open(const std::string& path) {
+        Close();
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            Close();
+            return false;
+        }
+        length = (size_t)fileSize.QuadPart;
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) {
+            Close();
+            return false;
+        }
+        bytes = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            Close();
+            return false;
+        }
+        length = (size_t)info.st_size;
+
+        void* view = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        bytes = (view == MAP_FAILED) ? nullptr : (const char*)view;
+#endif
+        if (!bytes) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+#if defined(_WIN32)
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes) munmap((void*)bytes, length);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+
+    bool IsOpen() const { return bytes != nullptr; }
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <memory>
 #include "image.h"
 
 struct Nail {
@@ -12,6 +13,29 @@ struct Nail {
         : id(id), x(x), y(y), angle(angle) {}
 };
 
+// Read-only view of the pixel indices of one palette line.
+struct LineSpan {
+    const int* first = nullptr;
+    const int* last = nullptr;
+
+    LineSpan() = default;
+    LineSpan(const int* first, const int* last) : first(first), last(last) {}
+
+    const int* begin() const { return first; }
+    const int* end() const { return last; }
+    const int* data() const { return first; }
+    int size() const { return (int)(last - first); }
+    bool empty() const { return first == last; }
+    int operator[](int i) const { return first[i]; }
+};
+
+// Caller-owned buffer a palette builds a line in. A line served from a
+// shared cache is not copied; pin keeps the cached pixels alive instead.
+struct LineScratch {
+    std::vector<int> pixels;
+    std::shared_ptr<const std::vector<int>> pin;
+};
+
 struct LineConnection {
     int fromNailId;
     int toNailId;
@@ -46,21 +70,146 @@ public:
     void setProcessingTimeMs(long value) { processingTimeMs = value; }
 };
 
+enum class IntensityModel {
+    Residual, // double intensity + residual per pixel
+    HitCount  // one byte of line hits per pixel, table-driven scoring
+};
+
+enum class PaletteMode {
+    Flat,      // every line stored
+    Symmetric, // one line per D4 orbit, others mapped on the fly
+    OnDemand   // lines rasterized when first used, kept in a bounded cache
+};
+
+enum class SimdLevel {
+    Auto,   // best level detected at runtime
+    Scalar,
+    Avx2,
+    Avx512
+};
+
+enum class SelectionMode {
+    Exhaustive,     // score every candidate line each iteration
+    Lazy,           // reuse stale scores from a per-nail max-heap, rescore only the top
+    Incremental,    // keep every line's score live through a pixel -> lines index
+    BranchAndBound, // score in order of a stale upper bound, stop once none can win
+    Screened,       // rank on a low-res gain map, rescore the top k exactly
+    Batched         // reuse each sweep for later lines that miss the pixels committed since
+};
+
+enum class AnnealingSchedule {
+    Geometric, // T = T0 * (T1 / T0)^progress
+    Linear     // T = T0 + (T1 - T0) * progress
+};
+
 struct GenerationParameters {
     std::string inputImagePath;
     std::string outputDirectory;
+    std::string paletteCacheDirectory = "palette_cache";
+    PaletteMode paletteMode = PaletteMode::Flat;
+    int paletteMemoryBudgetMb = 1024; // OnDemand mode only
     int imageResolution = 360;
     int nailCount = 360;
     int maxIterations = 1000;
     bool exportJson = true;
     bool exportPng = true;
     double lineAlpha = 0.1;
+    int minGap = 8;                     // minimum nail distance of a line
+    double improvementThreshold = 0.005; // stop when the best MSE gain is below
     int stage = 1;
+    int threads = 0; // 0 = one per hardware thread
+    IntensityModel intensityModel = IntensityModel::Residual;
+    SimdLevel simdLevel = SimdLevel::Auto;
+    SelectionMode selectionMode = SelectionMode::Exhaustive;
+    int screeningFactor = 4;        // Screened mode: low-res palette is 1/factor
+    int screeningTopK = 16;         // candidates rescored at full resolution
+    int screeningAuditInterval = 0; // compare with the exhaustive winner every n iterations, 0 = never
+    int batchMaxLines = 128;        // Batched mode: lines per round before swept scores are dropped
+    double batchQuality = 0.95;     // take a line to an already swept nail if it scores this share of the best
+    int beamWidth = 4;              // BeamSearchOptimizer: partial sequences kept per step
+    int refineTimeMs = 0;           // LocalSearch time budget after optimizing, 0 = no refinement
+    int refineWindow = 32;          // LocalSearch: shuffled path nodes per parallel task
+    int annealTimeMs = 0;           // SimulatedAnnealing time budget after optimizing, 0 = no annealing
+    long long annealMoves = 0;      // move budget, 0 = time budget only
+    double annealStartTemperature = 0.0; // in MSE units, 0 = calibrate from annealStartAcceptance
+    double annealEndTemperature = 0.0;   // 0 = start temperature * annealCoolingRatio
+    double annealStartAcceptance = 0.005; // share of random moves accepted at the start
+    double annealCoolingRatio = 0.001;
+    AnnealingSchedule annealSchedule = AnnealingSchedule::Geometric;
+    double annealRerouteWeight = 0.5; // relative frequency of each move type
+    double annealReverseWeight = 0.3;
+    double annealRemoveWeight = 0.1;
+    double annealInsertWeight = 0.1;
+    double annealSpliceWeight = 0.2;
+    int annealMaxSegment = 32;      // longest subpath a Reverse or Splice move takes
+    int annealTraceInterval = 100000; // moves between trace samples
+    unsigned annealSeed = 1;
+};
+
+// One stage of an optimization schedule. resolution 0 means
+// GenerationParameters::imageResolution.
+struct StageSpec {
+    std::string name;
+    double lineAlpha = 0.1;
+    int minGap = 8;
+    int maxIterations = 1000;
+    double threshold = 0.005;
+    int resolution = 0;
+};
+
+// Candidate scoring work of one optimization run. A candidate is skipped
+// when its line was eligible but the selection reused an earlier score.
+// Batched mode counts one iteration per committed line; sweeps counts its
+// full scorings of a node's candidates.
+struct SelectionStats {
+    long long iterations = 0;
+    long long sweeps = 0;
+    long long scored = 0;
+    long long skipped = 0;
+
+    double SkippedPerIteration() const { return iterations ? (double)skipped / iterations : 0.0; }
+    double ScoredPerIteration() const { return iterations ? (double)scored / iterations : 0.0; }
+    double SkipRate() const { return scored + skipped ? (double)skipped / (scored + skipped) : 0.0; }
+};
+
+// Screened selection checked against the exhaustive scan on audit
+// iterations. lowResMisses counts how often the best low-res candidate was
+// not the exact winner; misses counts how often the line actually chosen
+// (best of the rescored top k) was not.
+struct ScreeningStats {
+    long long audits = 0;
+    long long lowResMisses = 0;
+    long long misses = 0;
+    double improvementLost = 0.0; // sum over audits of exact best - chosen, MSE units
+
+    double MissRate() const { return audits ? (double)misses / audits : 0.0; }
+    double LowResMissRate() const { return audits ? (double)lowResMisses / audits : 0.0; }
 };
 
 struct GenerationResult {
     std::vector<LineConnection> lineSequence;
+    std::vector<double> lineAlphas; // alpha each line was drawn with; empty = not known
     Image renderedImage;
     QualityMetrics metrics;
+    SelectionStats selection;
+    ScreeningStats screening;
     std::vector<Nail> nails;
-};
\ No newline at end of file
+};
+
+// Where an optimization run starts: the canvas, the nail the thread is on and
+// the lines already drawn. A default state is a blank canvas at nail 0.
+struct OptimizerState {
+    Image intensity;       // empty = blank canvas
+    int currentNail = 0;
+    std::vector<LineConnection> lineSequence;
+    std::vector<double> lineAlphas; // one per line of lineSequence, or empty if not known
+
+    static OptimizerState FromResult(const GenerationResult& result) {
+        OptimizerState state;
+        state.intensity = result.renderedImage;
+        state.lineSequence = result.lineSequence;
+        state.lineAlphas = result.lineAlphas;
+        if (!result.lineSequence.empty()) state.currentNail = result.lineSequence.back().toNailId;
+        return state;
+    }
+};
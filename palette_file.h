@@ -0,0 +1,129 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include "models.h"
+#include "mapped_file.h"
+
+// On-disk LinePalette: a fixed header followed by the offsets array and the
+// pixel array exactly as LinePalette keeps them in memory, so a loaded file
+// is used in place through a read-only mapping.
+namespace PaletteFile {
+
+	constexpr std::uint32_t kMagic = 0x4C504153; // "SAPL"
+	constexpr std::uint32_t kVersion = 2;
+	constexpr std::uint32_t kRasterizerBresenham = 1;
+	constexpr std::uint32_t kByteOrderMark = 0x01020304; // reads back as 0x04030201 across byte orders
+
+	struct Header {
+		std::uint32_t magic = kMagic;
+		std::uint32_t version = kVersion;
+		std::uint32_t rasterizer = kRasterizerBresenham;
+		std::int32_t nailCount = 0;
+		std::int32_t width = 0;
+		std::int32_t height = 0;
+		std::uint64_t layoutHash = 0;
+		std::int64_t pairCount = 0;
+		std::int64_t pixelCount = 0;
+		std::uint32_t byteOrder = kByteOrderMark;
+		std::uint32_t reserved32 = 0;
+		std::uint64_t reserved = 0;
+	};
+	static_assert(sizeof(Header) == 64, "palette header must stay 64 bytes");
+
+	// FNV-1a over the integer nail positions the rasterizer actually uses.
+	inline std::uint64_t HashLayout(const std::vector<Nail>& nails) {
+		std::uint64_t hash = 1469598103934665603ULL;
+		auto mix = [&](std::int32_t value) {
+			for (int i = 0; i < 4; i++) {
+				hash ^= (std::uint64_t)((value >> (i * 8)) & 0xFF);
+				hash *= 1099511628211ULL;
+			}
+		};
+		for (const auto& nail : nails) {
+			mix((std::int32_t)nail.x);
+			mix((std::int32_t)nail.y);
+		}
+		return hash;
+	}
+
+	inline std::string CachePath(const std::string& directory, const Header& key) {
+		char name[128];
+		snprintf(name, sizeof(name), "palette_n%d_%dx%d_r%u_%016llx.bin",
+			key.nailCount, key.width, key.height, key.rasterizer,
+			(unsigned long long)key.layoutHash);
+		return (std::filesystem::path(directory) / name).string();
+	}
+
+	// Maps the file and checks it against the expected key. Returns null if the
+	// file is missing, stale, truncated, from a host of the other byte order,
+	// or its arrays do not describe valid lines (offsets that start at 0,
+	// never decrease and end at pixelCount; pixel indices inside the image),
+	// since LinePalette::GetLine trusts them. The check reads the whole file
+	// once.
+	inline std::shared_ptr<MappedFile> Open(const std::string& path, const Header& key) {
+		auto file = std::make_shared<MappedFile>();
+		if (!file->Open(path) || file->size() < sizeof(Header)) return nullptr;
+
+		Header header;
+		std::memcpy(&header, file->data(), sizeof(Header));
+		if (header.magic != kMagic || header.byteOrder != kByteOrderMark || header.version != kVersion ||
+			header.rasterizer != key.rasterizer || header.nailCount != key.nailCount ||
+			header.width != key.width || header.height != key.height ||
+			header.layoutHash != key.layoutHash || header.pairCount != key.pairCount) {
+			return nullptr;
+		}
+
+		std::uint64_t expected = sizeof(Header)
+			+ (std::uint64_t)(header.pairCount + 1) * sizeof(std::int64_t)
+			+ (std::uint64_t)header.pixelCount * sizeof(int);
+		if (file->size() != expected) return nullptr;
+
+		const std::int64_t* offsets = (const std::int64_t*)(file->data() + sizeof(Header));
+		const int* pixels = (const int*)(offsets + header.pairCount + 1);
+		if (offsets[0] != 0 || offsets[header.pairCount] != header.pixelCount) return nullptr;
+		for (std::int64_t i = 0; i < header.pairCount; i++) {
+			if (offsets[i + 1] < offsets[i]) return nullptr;
+		}
+		std::uint32_t area = (std::uint32_t)header.width * (std::uint32_t)header.height;
+		for (std::int64_t i = 0; i < header.pixelCount; i++) {
+			if ((std::uint32_t)pixels[i] >= area) return nullptr;
+		}
+		return file;
+	}
+
+	// Writes to a temporary name and renames it into place, so concurrent
+	// readers never map a half-written file.
+	inline bool Write(const std::string& path, Header header,
+		const std::int64_t* offsets, const int* pixels) {
+		namespace fs = std::filesystem;
+		std::error_code ec;
+		fs::create_directories(fs::path(path).parent_path(), ec);
+
+		std::string tempPath = path + "." +
+			std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+		bool written;
+		{
+			std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+			header.pixelCount = offsets[header.pairCount];
+			out.write((const char*)&header, sizeof(Header));
+			out.write((const char*)offsets, (std::streamsize)((header.pairCount + 1) * sizeof(std::int64_t)));
+			out.write((const char*)pixels, (std::streamsize)(header.pixelCount * sizeof(int)));
+			written = (bool)out;
+		}
+
+		if (written) fs::rename(tempPath, path, ec);
+		if (!written || ec) {
+			fs::remove(tempPath, ec);
+			return false;
+		}
+		return true;
+	}
+
+};
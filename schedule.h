@@ -0,0 +1,291 @@
+#pragma once
+#include "image.h"
+#include "models.h"
+#include "services.h"
+#include "algorithms.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+namespace Schedule {
+
+	// The coarse-structure / fine-tuning pair the generator has always run.
+	inline std::vector<StageSpec> DefaultSchedule() {
+		StageSpec coarse;
+		coarse.name = "coarse";
+		coarse.lineAlpha = 0.05;
+		coarse.minGap = 16;
+		coarse.maxIterations = 500;
+		coarse.threshold = 0.005;
+
+		StageSpec fine;
+		fine.name = "fine";
+		fine.lineAlpha = 0.1;
+		fine.minGap = 8;
+		fine.maxIterations = 2000;
+		fine.threshold = 0.005;
+
+		return { coarse, fine };
+	}
+
+	// Coarse-to-fine: the first coarseShare of the line budget is solved at
+	// 1/factor resolution (split evenly over factors, coarsest first), the
+	// rest refines the lifted sequence at full resolution.
+	inline std::vector<StageSpec> Pyramid(int imageResolution, const std::vector<int>& factors = { 4, 2 },
+		int totalLines = 2500, double coarseShare = 0.6) {
+		std::vector<StageSpec> stages;
+		int coarseLines = (int)(totalLines * coarseShare);
+		for (size_t i = 0; i < factors.size(); i++) {
+			StageSpec level;
+			level.name = "1/" + std::to_string(factors[i]);
+			level.resolution = std::max(1, imageResolution / factors[i]);
+			level.maxIterations = coarseLines / (int)factors.size();
+			stages.push_back(level);
+		}
+
+		StageSpec full;
+		full.name = "full";
+		full.maxIterations = totalLines - coarseLines;
+		stages.push_back(full);
+		return stages;
+	}
+
+	// One stage per line as key=value pairs, e.g.
+	//   name=coarse alpha=0.05 gap=16 iterations=500 threshold=0.005 resolution=180
+	// Missing keys keep StageSpec defaults; '#' starts a comment.
+	inline bool Load(const std::string& path, std::vector<StageSpec>& stages, std::string& error) {
+		std::ifstream file(path);
+		if (!file.is_open()) {
+			error = "cannot open " + path;
+			return false;
+		}
+
+		stages.clear();
+		std::string line;
+		int lineNumber = 0;
+		while (std::getline(file, line)) {
+			lineNumber++;
+			line = line.substr(0, line.find('#'));
+
+			std::istringstream tokens(line);
+			std::string token;
+			StageSpec stage;
+			bool any = false;
+			while (tokens >> token) {
+				size_t eq = token.find('=');
+				if (eq == std::string::npos) {
+					error = path + ":" + std::to_string(lineNumber) + ": expected key=value, got '" + token + "'";
+					return false;
+				}
+				std::string key = token.substr(0, eq);
+				std::string value = token.substr(eq + 1);
+				try {
+					if (key == "name") stage.name = value;
+					else if (key == "alpha") stage.lineAlpha = std::stod(value);
+					else if (key == "gap") stage.minGap = std::stoi(value);
+					else if (key == "iterations") stage.maxIterations = std::stoi(value);
+					else if (key == "threshold") stage.threshold = std::stod(value);
+					else if (key == "resolution") stage.resolution = std::stoi(value);
+					else {
+						error = path + ":" + std::to_string(lineNumber) + ": unknown key '" + key + "'";
+						return false;
+					}
+				} catch (const std::exception&) {
+					error = path + ":" + std::to_string(lineNumber) + ": bad value for '" + key + "'";
+					return false;
+				}
+				any = true;
+			}
+
+			if (!any) continue;
+			if (stage.lineAlpha <= 0.0 || stage.lineAlpha > 1.0 || stage.maxIterations < 0 || stage.resolution < 0) {
+				error = path + ":" + std::to_string(lineNumber) + ": stage values out of range";
+				return false;
+			}
+			if (stage.name.empty()) stage.name = "stage" + std::to_string(stages.size() + 1);
+			stages.push_back(stage);
+		}
+
+		if (stages.empty()) {
+			error = path + ": no stages";
+			return false;
+		}
+		return true;
+	}
+
+};
+
+struct StageReport {
+	StageSpec spec;
+	int resolution = 0;
+	int linesAdded = 0;
+	double mse = 0.0;        // at the stage's resolution
+	double rmse = 0.0;
+	double fullResMse = 0.0; // sequence so far replayed at imageResolution
+	long timeMs = 0;         // including the stage's palette build and lift
+	double msPerMsePoint = 0.0; // timeMs per point of full-res MSE removed, 0 if none
+
+	SelectionStats selection;
+	ScreeningStats screening;
+};
+
+// Runs a list of stages as one optimization. Every stage continues from the
+// previous stage's canvas, nail and sequence. Palettes, targets and
+// optimizers are built once per resolution and shared by all stages at that
+// resolution; when the resolution changes, the sequence so far is replayed
+// (each line with the alpha of the stage that drew it) on the new palette.
+//
+// Stage alphas are thread opacities at imageResolution. A stage at a lower
+// resolution scores with alpha * resolution / imageResolution, the share of
+// a coarse pixel a thread actually covers.
+class StageRunner {
+private:
+	struct Level {
+		Image target;
+		std::unique_ptr<LinePalette> palette;
+		std::unique_ptr<GreedyOptimizer> optimizer;
+	};
+
+	GenerationParameters params;
+	std::function<Image(int)> loadTarget;
+	std::map<int, Level> levels;
+	std::vector<StageReport> reports;
+	double initialMse = 0.0;
+
+	Level& getLevel(int resolution) {
+		auto it = levels.find(resolution);
+		if (it != levels.end()) return it->second;
+
+		Level& level = levels[resolution];
+		level.target = loadTarget(resolution);
+		if (resolution != params.imageResolution) {
+			// Coarse levels reuse the full-res nail layout, scaled, so a
+			// lifted line runs where the coarse one did.
+			std::vector<Nail> nails = getLevel(params.imageResolution).palette->GetNails();
+			for (auto& nail : nails) {
+				nail.x = nail.x * resolution / params.imageResolution;
+				nail.y = nail.y * resolution / params.imageResolution;
+			}
+			level.palette = std::make_unique<LinePalette>(nails, resolution, resolution, params.threads);
+		} else if (params.paletteMode == PaletteMode::Flat) {
+			level.palette = std::make_unique<LinePalette>(params.nailCount, resolution, resolution,
+				params.paletteCacheDirectory, params.threads);
+		} else {
+			level.palette = std::make_unique<LinePalette>(params.nailCount, resolution, resolution,
+				params.paletteMode, params.threads, (std::int64_t)params.paletteMemoryBudgetMb << 20);
+		}
+		level.optimizer = std::make_unique<GreedyOptimizer>(level.palette.get());
+		return level;
+	}
+
+	double scaledAlpha(double alpha, int resolution) const {
+		if (resolution == params.imageResolution) return alpha;
+		return alpha * resolution / params.imageResolution;
+	}
+
+	Image replay(const Level& level, const std::vector<LineConnection>& sequence,
+		const std::vector<double>& lineAlphas) const {
+		int size = level.target.getWidth();
+		Image intensity(size, size);
+		auto& values = intensity.getData();
+		LineScratch scratch;
+		for (size_t i = 0; i < sequence.size(); i++) {
+			double alpha = scaledAlpha(lineAlphas[i], size);
+			for (int idx : level.palette->GetLine(sequence[i].fromNailId, sequence[i].toNailId, scratch)) {
+				values[idx] = values[idx] * (1.0 - alpha) + alpha;
+			}
+		}
+		return intensity;
+	}
+
+public:
+	// loadTarget(resolution) returns the target image at that resolution.
+	StageRunner(const GenerationParameters& params, std::function<Image(int)> loadTarget)
+		: params(params), loadTarget(std::move(loadTarget)) {}
+
+	GenerationResult Run(const std::vector<StageSpec>& schedule,
+		void (*progress)(int, int, const char*) = nullptr,
+		void (*onStage)(const StageReport&) = nullptr) {
+		reports.clear();
+		OptimizerState state;
+		std::vector<double> lineAlphas;
+		GenerationResult result;
+		int currentResolution = 0;
+
+		Level& full = getLevel(params.imageResolution);
+		initialMse = Algorithms::CalculateMSE(full.target, Image(params.imageResolution, params.imageResolution));
+		double previousMse = initialMse;
+
+		for (size_t s = 0; s < schedule.size(); s++) {
+			const StageSpec& spec = schedule[s];
+			int resolution = spec.resolution > 0 ? spec.resolution : params.imageResolution;
+
+			auto start = std::chrono::high_resolution_clock::now();
+			Level& level = getLevel(resolution);
+			if (resolution != currentResolution && !state.lineSequence.empty()) {
+				state.intensity = replay(level, state.lineSequence, lineAlphas);
+			}
+			currentResolution = resolution;
+
+			GenerationParameters stageParams = params;
+			stageParams.imageResolution = resolution;
+			stageParams.lineAlpha = scaledAlpha(spec.lineAlpha, resolution);
+			stageParams.minGap = spec.minGap;
+			stageParams.maxIterations = spec.maxIterations;
+			stageParams.improvementThreshold = spec.threshold;
+			stageParams.stage = (int)s + 1;
+
+			size_t before = state.lineSequence.size();
+			result = level.optimizer->Optimize(level.target, level.palette->GetNails(), stageParams, state, progress);
+			auto end = std::chrono::high_resolution_clock::now();
+
+			lineAlphas.resize(result.lineSequence.size(), spec.lineAlpha);
+			state = OptimizerState::FromResult(result);
+
+			StageReport report;
+			report.spec = spec;
+			report.resolution = resolution;
+			report.linesAdded = (int)(result.lineSequence.size() - before);
+			report.mse = result.metrics.getMse();
+			report.rmse = result.metrics.getRmse();
+			report.selection = result.selection;
+			report.screening = result.screening;
+			report.timeMs = (long)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+			report.fullResMse = resolution == params.imageResolution ? report.mse
+				: Algorithms::CalculateMSE(full.target, replay(full, result.lineSequence, lineAlphas));
+			if (previousMse > report.fullResMse) report.msPerMsePoint = report.timeMs / (previousMse - report.fullResMse);
+			previousMse = report.fullResMse;
+			reports.push_back(report);
+			if (onStage) onStage(report);
+		}
+
+		long totalMs = 0;
+		for (const auto& report : reports) totalMs += report.timeMs;
+		result.metrics.setProcessingTimeMs(totalMs);
+		result.lineAlphas = lineAlphas;
+		return result;
+	}
+
+	const std::vector<StageReport>& GetReports() const { return reports; }
+
+	// Full-res MSE of the canvas the first stage started from.
+	double GetInitialMse() const { return initialMse; }
+
+	// Target image of a resolution that has already been run.
+	const Image* GetTarget(int resolution) const {
+		auto it = levels.find(resolution);
+		return it == levels.end() ? nullptr : &it->second.target;
+	}
+
+	// Palette used for a resolution that has already been run.
+	const LinePalette* GetPalette(int resolution) const {
+		auto it = levels.find(resolution);
+		return it == levels.end() ? nullptr : it->second.palette.get();
+	}
+};
@@ -0,0 +1,232 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include "image.h"
+#include "models.h"
+#include "simd_kernels.h"
+
+// Keeps the rendered intensity together with a per-pixel residual
+// (target - predicted) so a candidate line can be scored by touching only
+// the pixels under it. Improvements are reported in MSE units, i.e. they
+// match Algorithms::CalculateImprovement for the same line.
+class ResidualScorer {
+private:
+    const Image* target;
+    Image intensity;
+    std::vector<double> residual;
+    double lineAlpha;
+    double invPixelCount;
+    ScoringKernels::KernelSet kernels;
+
+    double residualAt(int idx, double value) const {
+        return target->getData()[idx] - (255.0 - value * 255.0);
+    }
+
+public:
+    ResidualScorer(const Image& target, double lineAlpha, SimdLevel simd = SimdLevel::Auto)
+        : target(&target), lineAlpha(lineAlpha), kernels(ScoringKernels::SelectKernels(simd)) {
+        int size = target.getWidth();
+        invPixelCount = size > 0 ? 1.0 / ((double)size * size) : 0.0;
+        Image blank(size, size);
+        Reset(blank);
+    }
+
+    void Reset(const Image& initial) {
+        intensity = initial;
+        residual.resize(intensity.getSize());
+        const auto& values = intensity.getData();
+        for (int i = 0; i < intensity.getSize(); i++) {
+            residual[i] = residualAt(i, values[i]);
+        }
+    }
+
+    double Score(LineSpan pixels) const {
+        return kernels.residualGain(pixels.data(), pixels.size(),
+            residual.data(), intensity.getData().data(), lineAlpha) * invPixelCount;
+    }
+
+    // Upper bound on what the line can gain now or after any further commits.
+    // A pixel only gains when it is brighter than its target by m = -r, and
+    // then gains d(2m - d) <= min(m^2, 2dm); commits only shrink m and d.
+    double Potential(LineSpan pixels) const {
+        const auto& values = intensity.getData();
+        double scale = 255.0 * lineAlpha;
+        double bound = 0.0;
+        for (int idx : pixels) {
+            double m = -residual[idx];
+            if (m <= 0.0) continue;
+            double d = scale * (1.0 - values[idx]);
+            bound += std::min(m * m, 2.0 * d * m);
+        }
+        return bound * invPixelCount;
+    }
+
+    // Unnormalized gain of one pixel; Score is the scaled sum over a line.
+    double PixelGain(int idx) const {
+        double d = 255.0 * lineAlpha * (1.0 - intensity.getData()[idx]);
+        return -d * (2.0 * residual[idx] + d);
+    }
+
+    void Commit(LineSpan pixels) {
+        auto& values = intensity.getData();
+        for (int idx : pixels) {
+            values[idx] = values[idx] * (1.0 - lineAlpha) + lineAlpha;
+            residual[idx] = residualAt(idx, values[idx]);
+        }
+    }
+
+    const Image& GetIntensity() const { return intensity; }
+    double GetPixelScale() const { return invPixelCount; }
+    double GetLineAlpha() const { return lineAlpha; }
+    const char* GetKernelName() const { return kernels.name; }
+};
+
+// Intensities a pixel takes after k lines of one alpha, up to maxHits: the
+// first count at which another line would move the pixel by less than half
+// a gray level. Shared by every model that tables errors by hit count.
+struct HitLevels {
+    std::vector<double> levels; // intensity after k hits, k = 0..maxHits
+    int maxHits = 0;
+
+    explicit HitLevels(double lineAlpha) {
+        levels.assign(1, 0.0);
+        while (maxHits < 255 && (1.0 - levels.back()) * 255.0 >= 0.5) {
+            levels.push_back(levels.back() * (1.0 - lineAlpha) + lineAlpha);
+            maxHits++;
+        }
+    }
+
+    int Stride() const { return maxHits + 1; }
+
+    // [target * Stride() + k] = squared error of a pixel with target level
+    // t after k hits.
+    std::vector<double> ErrorTable() const {
+        int stride = Stride();
+        std::vector<double> table(256 * stride);
+        for (int t = 0; t < 256; t++) {
+            for (int k = 0; k <= maxHits; k++) {
+                double diff = t - (255.0 - levels[k] * 255.0);
+                table[t * stride + k] = diff * diff;
+            }
+        }
+        return table;
+    }
+};
+
+// Every line multiplies the uncovered part of a pixel by (1 - alpha), so a
+// pixel hit k times has intensity 1 - (1 - alpha)^k no matter in which order
+// the lines were drawn. This scorer keeps one byte of hit count per pixel and
+// reads candidate gains from a (target level, hit count) table.
+//
+// Hit counts saturate once another line would move the rendered pixel by less
+// than half a gray level; further hits on that pixel score zero.
+class HitCountScorer {
+private:
+    std::vector<unsigned char> targetLevel;
+    std::vector<unsigned char> hits; // padded for the byte gathers
+    std::vector<double> levels;   // intensity after k hits
+    std::vector<double> gainTable; // [target * stride + k] = err(k) - err(k + 1)
+    std::vector<double> potentialTable; // [target * stride + k] = max(0, gains from k on)
+    int size;
+    int maxHits;
+    int stride;
+    double lineAlpha;
+    double invPixelCount;
+    ScoringKernels::KernelSet kernels;
+
+    void buildTables() {
+        HitLevels hitLevels(lineAlpha);
+        levels = hitLevels.levels;
+        maxHits = hitLevels.maxHits;
+        stride = hitLevels.Stride();
+
+        std::vector<double> errorTable = hitLevels.ErrorTable();
+        gainTable.assign(256 * stride, 0.0);
+        for (int t = 0; t < 256; t++) {
+            for (int k = 0; k < maxHits; k++) {
+                gainTable[t * stride + k] = errorTable[t * stride + k] - errorTable[t * stride + k + 1];
+            }
+        }
+
+        potentialTable.assign(256 * stride, 0.0);
+        for (int t = 0; t < 256; t++) {
+            for (int k = maxHits - 1; k >= 0; k--) {
+                potentialTable[t * stride + k] = std::max(gainTable[t * stride + k], potentialTable[t * stride + k + 1]);
+            }
+        }
+    }
+
+public:
+    HitCountScorer(const Image& target, double lineAlpha, SimdLevel simd = SimdLevel::Auto)
+        : size(target.getWidth()), lineAlpha(lineAlpha), kernels(ScoringKernels::SelectKernels(simd)) {
+        invPixelCount = size > 0 ? 1.0 / ((double)size * size) : 0.0;
+        buildTables();
+
+        const auto& values = target.getData();
+        targetLevel.assign(values.size() + ScoringKernels::kGatherPadding, 0);
+        for (size_t i = 0; i < values.size(); i++) {
+            double v = std::min(255.0, std::max(0.0, values[i]));
+            targetLevel[i] = (unsigned char)(v + 0.5);
+        }
+        hits.assign(values.size() + ScoringKernels::kGatherPadding, 0);
+    }
+
+    // Starts from an existing canvas, taking each pixel's hit count as the
+    // one whose intensity is closest under this scorer's alpha. Exact when
+    // the canvas was drawn with the same alpha.
+    void Reset(const Image& initial) {
+        const auto& values = initial.getData();
+        for (size_t i = 0; i < values.size() && i + ScoringKernels::kGatherPadding < hits.size(); i++) {
+            auto it = std::lower_bound(levels.begin(), levels.end(), values[i]);
+            int k = (int)(it - levels.begin());
+            if (k > maxHits) k = maxHits;
+            else if (k > 0 && values[i] - levels[k - 1] < levels[k] - values[i]) k--;
+            hits[i] = (unsigned char)k;
+        }
+    }
+
+    double Score(LineSpan pixels) const {
+        return kernels.hitCountGain(pixels.data(), pixels.size(),
+            targetLevel.data(), hits.data(), gainTable.data(), stride) * invPixelCount;
+    }
+
+    // Upper bound on what the line can gain now or after any further commits.
+    double Potential(LineSpan pixels) const {
+        double bound = 0.0;
+        for (int idx : pixels) bound += potentialTable[targetLevel[idx] * stride + hits[idx]];
+        return bound * invPixelCount;
+    }
+
+    double PixelGain(int idx) const {
+        return gainTable[targetLevel[idx] * stride + hits[idx]];
+    }
+
+    // Gain of one more line on pixel idx when it has been hit hitCount times;
+    // lets callers keep hit counts of their own and score against the tables.
+    double GainAt(int idx, int hitCount) const {
+        return gainTable[targetLevel[idx] * stride + hitCount];
+    }
+
+    double GetLevel(int hitCount) const { return levels[hitCount]; }
+
+    void Commit(LineSpan pixels) {
+        for (int idx : pixels) {
+            if (hits[idx] < maxHits) hits[idx]++;
+        }
+    }
+
+    Image GetIntensity() const {
+        Image intensity(size, size);
+        auto& values = intensity.getData();
+        for (size_t i = 0; i < values.size(); i++) {
+            values[i] = levels[hits[i]];
+        }
+        return intensity;
+    }
+
+    const std::vector<unsigned char>& GetHits() const { return hits; }
+    int GetMaxHits() const { return maxHits; }
+    double GetPixelScale() const { return invPixelCount; }
+    double GetLineAlpha() const { return lineAlpha; }
+    const char* GetKernelName() const { return kernels.name; }
+};
@@ -0,0 +1,198 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include "image.h"
+#include "models.h"
+#include "scoring.h"
+#include "services.h"
+
+// Energy of a whole thread sequence under the hit-count model: the squared
+// error of every pixel depends only on how many lines cross it, so the
+// energy of a sequence is a sum of table lookups over per-pixel counts and
+// the change caused by removing and adding a few lines only involves their
+// pixels. Counts are not saturated, so removing a line is exact; the error
+// table is flat beyond the saturation count.
+//
+// Only lines drawn with the energy's alpha are counted. Lines of other
+// alphas (earlier stages of a schedule) are fixed: they are folded into a
+// per-pixel background that the counted lines cover further, and callers
+// must not move them.
+//
+// Energies are in MSE units. Pending and Discard on a caller-owned Change
+// and LineDelta may run concurrently; Apply may not.
+class SequenceEnergy {
+public:
+    // Scratch for evaluating one move: net count change per touched pixel.
+    // Each thread needs its own.
+    struct Change {
+        std::vector<std::int16_t> count;
+        std::vector<int> touched;
+        double delta = 0.0; // raw squared error, see SequenceEnergy::Scale
+    };
+
+private:
+    const LinePalette* palette;
+    double lineAlpha;
+    std::vector<unsigned char> targetLevel;
+    std::vector<std::uint16_t> hits;
+    std::vector<double> errorTable; // [target * stride + min(k, maxHits)]
+    std::vector<double> levels;
+    std::vector<double> uncovered;  // share of each pixel the fixed lines leave open; empty = none
+    std::vector<float> addDelta;    // error change of one more line per pixel, if tracked
+    std::vector<float> removeDelta; // and of one line less
+    int maxHits = 0;
+    int stride = 0;
+    int pixelCount = 0;
+    double invPixelCount = 0.0;
+    double energy = 0.0; // raw
+
+    double intensityAt(int idx, int k) const {
+        double level = levels[std::min(k, maxHits)];
+        return uncovered.empty() ? level : 1.0 - uncovered[idx] * (1.0 - level);
+    }
+
+    double errorAt(int idx, int k) const {
+        if (uncovered.empty()) return errorTable[targetLevel[idx] * stride + std::min(k, maxHits)];
+        double diff = targetLevel[idx] - (255.0 - intensityAt(idx, k) * 255.0);
+        return diff * diff;
+    }
+
+    void refreshDeltas(int idx) {
+        int k = hits[idx];
+        addDelta[idx] = (float)(errorAt(idx, k + 1) - errorAt(idx, k));
+        removeDelta[idx] = k > 0 ? (float)(errorAt(idx, k - 1) - errorAt(idx, k)) : 0.0f;
+    }
+
+public:
+    SequenceEnergy(const Image& target, const LinePalette* palette, double lineAlpha)
+        : palette(palette), lineAlpha(lineAlpha) {
+        HitLevels hitLevels(lineAlpha);
+        levels = hitLevels.levels;
+        maxHits = hitLevels.maxHits;
+        stride = hitLevels.Stride();
+        errorTable = hitLevels.ErrorTable();
+
+        const auto& values = target.getData();
+        pixelCount = target.getSize();
+        invPixelCount = pixelCount > 0 ? 1.0 / pixelCount : 0.0;
+        targetLevel.resize(pixelCount);
+        for (int i = 0; i < pixelCount; i++) {
+            double v = std::min(255.0, std::max(0.0, values[i]));
+            targetLevel[i] = (unsigned char)(v + 0.5);
+        }
+        hits.assign(pixelCount, 0);
+    }
+
+    // Whether line i of a sequence with these alphas is counted, and may
+    // therefore be moved; an empty lineAlphas means every line is.
+    bool IsCounted(const std::vector<double>& lineAlphas, size_t i) const {
+        return lineAlphas.empty() || lineAlphas[i] == lineAlpha;
+    }
+
+    // lineAlphas holds the alpha of each line of path, or is empty when all
+    // were drawn with the energy's alpha.
+    void Load(const std::vector<int>& path, const std::vector<double>& lineAlphas = std::vector<double>()) {
+        std::fill(hits.begin(), hits.end(), 0);
+        uncovered.clear();
+        LineScratch scratch;
+        for (size_t i = 0; i + 1 < path.size(); i++) {
+            if (IsCounted(lineAlphas, i)) {
+                for (int idx : palette->GetLine(path[i], path[i + 1], scratch)) hits[idx]++;
+                continue;
+            }
+            if (uncovered.empty()) uncovered.assign(pixelCount, 1.0);
+            for (int idx : palette->GetLine(path[i], path[i + 1], scratch)) uncovered[idx] *= 1.0 - lineAlphas[i];
+        }
+        energy = 0.0;
+        for (int i = 0; i < pixelCount; i++) energy += errorAt(i, hits[i]);
+        if (!addDelta.empty()) {
+            for (int i = 0; i < pixelCount; i++) refreshDeltas(i);
+        }
+    }
+
+    // Keeps the per-pixel error change of adding or removing one line up to
+    // date from now on, which LineDelta needs. Costs two floats per pixel and
+    // a refresh of the touched pixels on every Apply.
+    void TrackLineDeltas() {
+        addDelta.resize(pixelCount);
+        removeDelta.resize(pixelCount);
+        for (int i = 0; i < pixelCount; i++) refreshDeltas(i);
+    }
+
+    // Raw error change of adding (sign = +1) or removing (sign = -1) one line
+    // on its own. A move's LineDelta sum is exact unless its lines share
+    // pixels, which they mostly do only next to a common nail.
+    double LineDelta(int from, int to, int sign, LineScratch& scratch) const {
+        const float* deltas = sign > 0 ? addDelta.data() : removeDelta.data();
+        float sum = 0.0f;
+        for (int idx : palette->GetLine(from, to, scratch)) sum += deltas[idx];
+        return sum;
+    }
+
+    Change MakeChange() const {
+        Change change;
+        change.count.assign(pixelCount, 0);
+        return change;
+    }
+
+    // Adds (sign = +1) or removes (sign = -1) a line in a pending change,
+    // updating change.delta pixel by pixel.
+    void Pending(Change& change, int from, int to, int sign, LineScratch& scratch) const {
+        for (int idx : palette->GetLine(from, to, scratch)) {
+            int before = hits[idx] + change.count[idx];
+            if (change.count[idx] == 0) change.touched.push_back(idx);
+            change.count[idx] += sign;
+            change.delta += errorAt(idx, before + sign) - errorAt(idx, before);
+        }
+    }
+
+    // Clears a change so the scratch can be reused.
+    void Discard(Change& change) const {
+        for (int idx : change.touched) change.count[idx] = 0;
+        change.touched.clear();
+        change.delta = 0.0;
+    }
+
+    // Commits a pending change to the counts and clears it.
+    void Apply(Change& change) {
+        for (int idx : change.touched) {
+            hits[idx] = (std::uint16_t)(hits[idx] + change.count[idx]);
+            change.count[idx] = 0;
+            if (!addDelta.empty()) refreshDeltas(idx);
+        }
+        energy += change.delta;
+        change.touched.clear();
+        change.delta = 0.0;
+    }
+
+    double GetEnergy() const { return energy * invPixelCount; }
+    double Scale() const { return invPixelCount; }
+
+    Image Render() const {
+        int size = palette->GetWidth();
+        Image intensity(size, palette->GetHeight());
+        auto& values = intensity.getData();
+        for (int i = 0; i < pixelCount; i++) values[i] = intensityAt(i, hits[i]);
+        return intensity;
+    }
+
+    // Nail path of a continuous sequence; empty if consecutive lines do not
+    // share a nail.
+    static std::vector<int> ToPath(const std::vector<LineConnection>& sequence) {
+        std::vector<int> path;
+        if (sequence.empty()) return path;
+        path.push_back(sequence[0].fromNailId);
+        for (size_t i = 0; i < sequence.size(); i++) {
+            if (sequence[i].fromNailId != path.back()) return std::vector<int>();
+            path.push_back(sequence[i].toNailId);
+        }
+        return path;
+    }
+
+    static std::vector<LineConnection> ToSequence(const std::vector<int>& path) {
+        std::vector<LineConnection> sequence;
+        for (size_t i = 0; i + 1 < path.size(); i++) sequence.emplace_back(path[i], path[i + 1], (int)i);
+        return sequence;
+    }
+};
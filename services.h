@@ -2,10 +2,21 @@
 #include "image.h"
 #include "models.h"
 #include "algorithms.h"
-#include <map>
+#include "scoring.h"
+#include "thread_pool.h"
+#include "palette_file.h"
+#include "symmetry.h"
+#include "line_cache.h"
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <vector>
 #include <deque>
 #include <chrono>
+#include <memory>
+#include <thread>
+#include <string>
 
 class Utils {
 public:
@@ -23,44 +34,459 @@ public:
     }
 };
 
+// All nail-to-nail lines in one contiguous block: the pixels of pair
+// (from, to), from < to, live in pixels[offsets[k], offsets[k + 1]) where k
+// is the pair's row-major index in the upper triangle. The arrays are either
+// owned or point into a memory-mapped palette file.
+//
+// In Symmetric mode the block holds only stored lines, as packed
+// (x | y << 16) coordinates, and pairCodes[k] = stored index << 3 | g says
+// which symmetry g turns a stored line into pair k. Stored lines are each
+// orbit's canonical line plus the few members no stored line maps onto
+// exactly.
+//
+// OnDemand mode stores nothing up front: lines are rasterized on first use
+// and kept in a LineCache limited to a memory budget.
 class LinePalette {
 private:
-    std::map<std::pair<int, int>, std::vector<int>> cache;
+    std::vector<std::int64_t> offsets;
+    std::vector<int> pixels;
+    std::vector<std::uint32_t> pairCodes;
+    std::shared_ptr<MappedFile> mapping;
+    std::unique_ptr<LineCache> lineCache;
+    const std::int64_t* offsetData = nullptr;
+    const int* pixelData = nullptr;
     std::vector<Nail> nails;
+    PaletteMode mode = PaletteMode::Flat;
+    int nailCount = 0;
+    int width = 0;
+    int height = 0;
+    bool loadedFromCache = false;
 
-    void precomputePalette(int nailCount, int width, int height) {
-        cache.clear();
+    std::int64_t pairIndex(int f, int t) const {
+        return (std::int64_t)f * (2 * nailCount - f - 1) / 2 + (t - f - 1);
+    }
+
+    std::int64_t pairCount() const {
+        return (std::int64_t)nailCount * (nailCount - 1) / 2;
+    }
+
+    void generateNails(int nailCount, int width, int height) {
+        this->nailCount = nailCount;
+        this->width = width;
+        this->height = height;
         Utils gen;
         nails = gen.GenerateNails(nailCount, width / 2.0, height / 2.0, width / 2.0 - 5);
+    }
 
-        for (int i = 0; i < nailCount; i++) {
+    PaletteFile::Header cacheKey() const {
+        PaletteFile::Header key;
+        key.nailCount = nailCount;
+        key.width = width;
+        key.height = height;
+        key.layoutHash = PaletteFile::HashLayout(nails);
+        key.pairCount = pairCount();
+        return key;
+    }
+
+    // Pass 1 stores every line's length, a prefix sum turns lengths into
+    // offsets, and pass 2 rasterizes each line straight into its final slot.
+    // Both passes run row by row on a thread pool.
+    void precomputePalette(int threads) {
+        offsets.assign(pairCount() + 1, 0);
+        ThreadPool pool(threads);
+
+        pool.ParallelForEach(nailCount, [&](int i, int) {
+            int x0 = (int)nails[i].x, y0 = (int)nails[i].y;
+            std::int64_t* lengths = offsets.data() + pairIndex(i, i + 1) + 1;
+            bool inside = x0 >= 0 && x0 < width && y0 >= 0 && y0 < height;
             for (int j = i + 1; j < nailCount; j++) {
-                auto pixels = Algorithms::BresenhamLine(
+                int x1 = (int)nails[j].x, y1 = (int)nails[j].y;
+                if (inside && x1 >= 0 && x1 < width && y1 >= 0 && y1 < height) {
+                    // Both ends on the raster: Bresenham visits max(dx, dy) + 1 pixels.
+                    lengths[j - i - 1] = std::max(std::abs(x1 - x0), std::abs(y1 - y0)) + 1;
+                } else {
+                    lengths[j - i - 1] = Algorithms::CountLinePixels(x0, y0, x1, y1, width, height);
+                }
+            }
+        });
+
+        for (std::int64_t k = 0; k < pairCount(); k++) {
+            offsets[k + 1] += offsets[k];
+        }
+
+        pixels.resize(offsets[pairCount()]);
+        pool.ParallelForEach(nailCount, [&](int i, int) {
+            for (int j = i + 1; j < nailCount; j++) {
+                int* out = pixels.data() + offsets[pairIndex(i, j)];
+                Algorithms::TraceLine(
                     (int)nails[i].x, (int)nails[i].y,
                     (int)nails[j].x, (int)nails[j].y,
-                    width, height
+                    width, height,
+                    [&](int idx) { *out++ = idx; }
                 );
-                cache[{i, j}] = pixels;
             }
+        });
+
+        offsetData = offsets.data();
+        pixelData = pixels.data();
+    }
+
+    std::int64_t normalizedPair(int a, int b) const {
+        return a < b ? pairIndex(a, b) : pairIndex(b, a);
+    }
+
+    void precomputeSymmetric(int threads) {
+        pairCodes.assign(pairCount(), 0);
+        std::vector<std::pair<int, int>> canonical;
+
+        // A pair is canonical when it has the lowest pair index of its orbit,
+        // so it is always visited before the rest of the orbit.
+        std::int64_t k = 0;
+        for (int i = 0; i < nailCount; i++) {
+            for (int j = i + 1; j < nailCount; j++, k++) {
+                std::int64_t lowest = k;
+                for (int g = 1; g < Symmetry::kGroupSize; g++) {
+                    std::int64_t image = normalizedPair(Symmetry::MapNail(g, i, nailCount),
+                                                        Symmetry::MapNail(g, j, nailCount));
+                    lowest = std::min(lowest, image);
+                }
+
+                if (lowest == k) {
+                    pairCodes[k] = (std::uint32_t)canonical.size() << 3;
+                    canonical.emplace_back(i, j);
+                    continue;
+                }
+
+                // Find the symmetry that carries the canonical line onto (i, j).
+                const auto& c = canonical[pairCodes[lowest] >> 3];
+                for (int g = 0; g < Symmetry::kGroupSize; g++) {
+                    if (normalizedPair(Symmetry::MapNail(g, c.first, nailCount),
+                                       Symmetry::MapNail(g, c.second, nailCount)) == k) {
+                        pairCodes[k] = (pairCodes[lowest] & ~7u) | (std::uint32_t)g;
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Nail positions are truncated and Bresenham breaks ties by
+        // direction, so a mapped line can differ from the pair's own walk.
+        // Each orbit member therefore uses the first stored line of its orbit
+        // that maps onto it exactly, and becomes a stored line itself when
+        // none does. Every line keeps the pixels it has in Flat mode.
+        ThreadPool pool(threads);
+        int orbitCount = (int)canonical.size();
+        std::vector<std::vector<std::pair<int, int>>> members(orbitCount);
+        for (int i = 0; i < nailCount; i++) {
+            for (int j = i + 1; j < nailCount; j++) {
+                int c = (int)(pairCodes[pairIndex(i, j)] >> 3);
+                if (canonical[c] != std::make_pair(i, j)) members[c].emplace_back(i, j);
+            }
+        }
+
+        std::vector<std::vector<std::pair<int, int>>> extra(orbitCount);
+        std::vector<std::vector<int>> own(pool.GetThreadCount()), image(pool.GetThreadCount());
+        pool.ParallelForEach(orbitCount, [&](int c, int worker) {
+            auto trace = [&](std::pair<int, int> line, int g, std::vector<int>& out) {
+                out.clear();
+                const Nail& a = nails[line.first];
+                const Nail& b = nails[line.second];
+                Algorithms::TraceLine((int)a.x, (int)a.y, (int)b.x, (int)b.y, width, height, [&](int idx) {
+                    int x = idx % width, y = idx / width;
+                    Symmetry::MapPixel(g, x, y, width);
+                    out.push_back(y * width + x);
+                });
+                std::sort(out.begin(), out.end());
+            };
+
+            // Stored lines of this orbit; index 0 is the canonical one.
+            std::vector<std::pair<int, int>> stored{ canonical[c] };
+            for (const auto& line : members[c]) {
+                std::int64_t member = pairIndex(line.first, line.second);
+                trace(line, 0, own[worker]);
+
+                std::uint32_t code = 0;
+                bool exact = false;
+                for (size_t r = 0; r < stored.size() && !exact; r++) {
+                    for (int g = 1; g < Symmetry::kGroupSize && !exact; g++) {
+                        if (normalizedPair(Symmetry::MapNail(g, stored[r].first, nailCount),
+                                           Symmetry::MapNail(g, stored[r].second, nailCount)) != member) continue;
+                        trace(stored[r], g, image[worker]);
+                        if (image[worker] == own[worker]) {
+                            code = (std::uint32_t)(r << 3) | (std::uint32_t)g;
+                            exact = true;
+                        }
+                    }
+                }
+                if (!exact) {
+                    code = (std::uint32_t)(stored.size() << 3);
+                    stored.push_back(line);
+                }
+                pairCodes[member] = code; // orbit-local until renumbered below
+            }
+            extra[c].assign(stored.begin() + 1, stored.end());
+        });
+
+        // Extra stored lines follow the canonical ones, orbit by orbit.
+        std::vector<int> firstExtra(orbitCount);
+        for (int c = 0; c < orbitCount; c++) {
+            firstExtra[c] = (int)canonical.size();
+            canonical.insert(canonical.end(), extra[c].begin(), extra[c].end());
         }
+        for (int c = 0; c < orbitCount; c++) {
+            for (const auto& line : members[c]) {
+                std::int64_t member = pairIndex(line.first, line.second);
+                std::uint32_t r = pairCodes[member] >> 3;
+                std::uint32_t global = r == 0 ? (std::uint32_t)c : (std::uint32_t)(firstExtra[c] + r - 1);
+                pairCodes[member] = (global << 3) | (pairCodes[member] & 7u);
+            }
+        }
+
+        int canonicalCount = (int)canonical.size();
+        offsets.assign(canonicalCount + 1, 0);
+
+        pool.ParallelForEach(canonicalCount, [&](int c, int) {
+            const Nail& a = nails[canonical[c].first];
+            const Nail& b = nails[canonical[c].second];
+            offsets[c + 1] = Algorithms::CountLinePixels(
+                (int)a.x, (int)a.y, (int)b.x, (int)b.y, width, height);
+        });
+        for (int c = 0; c < canonicalCount; c++) {
+            offsets[c + 1] += offsets[c];
+        }
+
+        pixels.resize(offsets[canonicalCount]);
+        pool.ParallelForEach(canonicalCount, [&](int c, int) {
+            const Nail& a = nails[canonical[c].first];
+            const Nail& b = nails[canonical[c].second];
+            int* out = pixels.data() + offsets[c];
+            Algorithms::TraceLine(
+                (int)a.x, (int)a.y, (int)b.x, (int)b.y, width, height,
+                [&](int idx) { *out++ = (idx % width) | ((idx / width) << 16); }
+            );
+        });
+
+        offsetData = offsets.data();
+        pixelData = pixels.data();
+    }
+
+    LineSpan decodeSymmetric(std::int64_t k, LineScratch& scratch) const {
+        std::uint32_t code = pairCodes[k];
+        int g = (int)(code & 7);
+        std::int64_t c = code >> 3;
+        const int* first = pixelData + offsetData[c];
+        int count = (int)(offsetData[c + 1] - offsetData[c]);
+
+        std::vector<int>& out = scratch.pixels;
+        out.resize(count);
+        for (int i = 0; i < count; i++) {
+            int x = first[i] & 0xFFFF;
+            int y = first[i] >> 16;
+            Symmetry::MapPixel(g, x, y, width);
+            out[i] = y * width + x;
+        }
+        return LineSpan(out.data(), out.data() + count);
+    }
+
+    LineSpan rasterizeOnDemand(int f, int t, LineScratch& scratch) const {
+        return lineCache->Get(pairIndex(f, t), scratch.pin, scratch.pixels, [&](std::vector<int>& out) {
+            out.clear();
+            Algorithms::TraceLine(
+                (int)nails[f].x, (int)nails[f].y,
+                (int)nails[t].x, (int)nails[t].y,
+                width, height,
+                [&](int idx) { out.push_back(idx); }
+            );
+        });
+    }
+
+    bool loadCache(const std::string& path, const PaletteFile::Header& key) {
+        mapping = PaletteFile::Open(path, key);
+        if (!mapping) return false;
+
+        const char* base = mapping->data() + sizeof(PaletteFile::Header);
+        offsetData = (const std::int64_t*)base;
+        pixelData = (const int*)(base + (key.pairCount + 1) * sizeof(std::int64_t));
+        return true;
     }
 
 public:
-    explicit LinePalette(int nailCount, int width, int height) {
-        precomputePalette(nailCount, width, height);
+    explicit LinePalette(int nailCount, int width, int height, int threads = 0) {
+        generateNails(nailCount, width, height);
+        precomputePalette(threads);
+    }
+
+    // Lines between the given nail positions, e.g. another palette's nails
+    // scaled to a smaller raster.
+    LinePalette(const std::vector<Nail>& nails, int width, int height, int threads = 0)
+        : nails(nails), nailCount((int)nails.size()), width(width), height(height) {
+        precomputePalette(threads);
+    }
+
+    // Maps a matching palette file from cacheDirectory if there is one,
+    // otherwise rasterizes the palette and stores it there for the next run.
+    LinePalette(int nailCount, int width, int height, const std::string& cacheDirectory, int threads = 0) {
+        generateNails(nailCount, width, height);
+        PaletteFile::Header key = cacheKey();
+        std::string path = PaletteFile::CachePath(cacheDirectory, key);
+
+        loadedFromCache = loadCache(path, key);
+        if (!loadedFromCache) {
+            precomputePalette(threads);
+            PaletteFile::Write(path, key, offsetData, pixelData);
+        }
+    }
+
+    // Symmetric mode needs a square raster and a nail count divisible by 4;
+    // otherwise the palette falls back to Flat (see GetMode()). Every line
+    // has exactly the pixels it has in Flat mode, possibly in another order.
+    //
+    // OnDemand mode keeps at most memoryBudgetBytes of rasterized lines.
+    LinePalette(int nailCount, int width, int height, PaletteMode requested, int threads = 0,
+                std::int64_t memoryBudgetBytes = (std::int64_t)256 << 20) {
+        generateNails(nailCount, width, height);
+        if (requested == PaletteMode::OnDemand) {
+            mode = PaletteMode::OnDemand;
+            lineCache = std::make_unique<LineCache>(memoryBudgetBytes, pairCount());
+        } else if (requested == PaletteMode::Symmetric && Symmetry::Applies(nailCount, width, height)) {
+            mode = PaletteMode::Symmetric;
+            precomputeSymmetric(threads);
+        } else {
+            precomputePalette(threads);
+        }
     }
 
     LinePalette() = delete;
+    LinePalette(const LinePalette&) = delete;
+    LinePalette& operator=(const LinePalette&) = delete;
 
-    const std::vector<int>& GetLine(int from, int to) const {
+    // Flat lines are returned in place; Symmetric lines are built in scratch
+    // and OnDemand lines come from the cache, pinned by scratch. Either way
+    // the span stays valid until scratch is reused, so spans held at the
+    // same time need scratches of their own.
+    LineSpan GetLine(int from, int to, LineScratch& scratch) const {
         int f = std::min(from, to);
         int t = std::max(from, to);
+        if (f == t || f < 0 || t >= nailCount) return LineSpan();
 
-        auto it = cache.find({f, t});
-        if (it != cache.end()) return it->second;
+        if (mode == PaletteMode::OnDemand) return rasterizeOnDemand(f, t, scratch);
+        std::int64_t k = pairIndex(f, t);
+        if (mode == PaletteMode::Symmetric) return decodeSymmetric(k, scratch);
+        return LineSpan(pixelData + offsetData[k], pixelData + offsetData[k + 1]);
+    }
 
-        static const std::vector<int> empty;
-        return empty;
+    // Index of the unordered pair (a, b) in [0, GetPairCount()).
+    std::int64_t GetPairIndex(int a, int b) const { return normalizedPair(a, b); }
+    std::int64_t GetPairCount() const { return pairCount(); }
+
+    // Whether a line may join nails a and b: distinct nails at least minGap
+    // apart around the ring.
+    bool IsEligible(int a, int b, int minGap) const {
+        if (a == b) return false;
+        int d = std::abs(a - b);
+        return std::min(d, nailCount - d) >= minGap;
+    }
+
+    int GetNailCount() const { return nailCount; }
+    int GetWidth() const { return width; }
+    int GetHeight() const { return height; }
+    const std::vector<Nail>& GetNails() const { return nails; }
+    PaletteMode GetMode() const { return mode; }
+
+    // Hit/miss counters of the OnDemand line cache; all zero in other modes.
+    LineCacheStats GetCacheStats() const {
+        return lineCache ? lineCache->GetStats() : LineCacheStats();
+    }
+    bool IsLoadedFromCache() const { return loadedFromCache; }
+
+    // Number of pixel entries actually stored.
+    std::int64_t GetPixelCount() const {
+        if (mode == PaletteMode::OnDemand) return lineCache->GetStats().pixels;
+        std::int64_t lines = mode == PaletteMode::Symmetric ? (std::int64_t)offsets.size() - 1 : pairCount();
+        return offsetData[lines];
+    }
+
+    std::int64_t GetMemoryBytes() const {
+        if (mode == PaletteMode::OnDemand) {
+            LineCacheStats stats = lineCache->GetStats();
+            return stats.bytes + stats.indexBytes;
+        }
+        std::int64_t lines = mode == PaletteMode::Symmetric ? (std::int64_t)offsets.size() - 1 : pairCount();
+        return (lines + 1) * (std::int64_t)sizeof(std::int64_t)
+            + GetPixelCount() * (std::int64_t)sizeof(int)
+            + (std::int64_t)pairCodes.size() * (std::int64_t)sizeof(std::uint32_t);
+    }
+};
+
+// Pixel -> lines map of a LinePalette in CSC form: the ids (palette pair
+// indices) of every line covering pixel p are lineIds[offsets[p]] up to
+// lineIds[offsets[p + 1]], in ascending order.
+//
+// Built once per palette from GetLine, so it works for every palette mode.
+class LineInverseIndex {
+private:
+    std::vector<std::int64_t> offsets;
+    std::vector<std::int32_t> lineIds;
+    int pixelCount = 0;
+
+public:
+    explicit LineInverseIndex(const LinePalette& palette) {
+        int nailCount = palette.GetNailCount();
+        pixelCount = palette.GetWidth() * palette.GetHeight();
+        offsets.assign(pixelCount + 1, 0);
+
+        LineScratch scratch;
+        for (int f = 0; f < nailCount; f++) {
+            for (int t = f + 1; t < nailCount; t++) {
+                for (int idx : palette.GetLine(f, t, scratch)) offsets[idx + 1]++;
+            }
+        }
+        for (int p = 0; p < pixelCount; p++) {
+            offsets[p + 1] += offsets[p];
+        }
+
+        lineIds.resize(offsets[pixelCount]);
+        std::vector<std::int64_t> fill(offsets.begin(), offsets.end() - 1);
+        for (int f = 0; f < nailCount; f++) {
+            for (int t = f + 1; t < nailCount; t++) {
+                std::int32_t id = (std::int32_t)palette.GetPairIndex(f, t);
+                for (int idx : palette.GetLine(f, t, scratch)) lineIds[fill[idx]++] = id;
+            }
+        }
+    }
+
+    LineInverseIndex(const LineInverseIndex&) = delete;
+    LineInverseIndex& operator=(const LineInverseIndex&) = delete;
+
+    const std::int32_t* LinesBegin(int pixel) const { return lineIds.data() + offsets[pixel]; }
+    const std::int32_t* LinesEnd(int pixel) const { return lineIds.data() + offsets[pixel + 1]; }
+    int GetLineCount(int pixel) const { return (int)(offsets[pixel + 1] - offsets[pixel]); }
+    int GetPixelCount() const { return pixelCount; }
+
+    std::int64_t GetMemoryBytes() const {
+        return (std::int64_t)offsets.size() * (std::int64_t)sizeof(std::int64_t)
+            + (std::int64_t)lineIds.size() * (std::int64_t)sizeof(std::int32_t);
+    }
+};
+
+struct CandidateChoice {
+    int nail = -1;
+    double improvement = -1.0;
+};
+
+// Last known score of the line from a heap's nail to `nail`, computed when
+// the optimizer had committed `stamp` lines.
+struct LazyCandidate {
+    double improvement;
+    int nail;
+    int stamp;
+
+    // Max-heap order; on equal scores the lower nail comes out first, as in
+    // the exhaustive scan.
+    bool operator<(const LazyCandidate& other) const {
+        if (improvement != other.improvement) return improvement < other.improvement;
+        return nail > other.nail;
     }
 };
 
@@ -68,62 +494,505 @@ class GreedyOptimizer {
 private:
     LinePalette* cache;
     std::deque<std::pair<int, double>> recentImprovements;
+    ReusableThreadPool pool;
+    std::vector<CandidateChoice> workerBest;
+    std::vector<LineScratch> workerScratch;
+    std::vector<std::vector<LazyCandidate>> lazyHeaps;
+    std::vector<double> candidateScores;
+    std::unique_ptr<LineInverseIndex> inverseIndex;
+    std::vector<std::int64_t> pixelGains;
+    std::vector<std::int64_t> lineScores;
+    std::vector<std::pair<int, std::int64_t>> changedPixels;
+
+    // Incremental scores are sums of per-pixel gains in 2^-28 fixed point,
+    // so applying deltas in any order gives exactly the freshly summed score.
+    static constexpr double kScoreScale = 268435456.0;
 
-    void ApplyLineWithAlpha(Image& intensity, int from, int to, double lineAlpha) {
-        const auto& pixels = cache->GetLine(from, to);
-        for (int idx : pixels) {
-            int y = idx / intensity.getWidth();
-            int x = idx % intensity.getWidth();
-            if (x >= 0 && x < intensity.getWidth() && y >= 0 && y < intensity.getHeight()) {
-                intensity.at(x, y) = intensity.at(x, y) * (1.0 - lineAlpha) + lineAlpha;
+    static std::int64_t quantizeGain(double gain) { return std::llround(gain * kScoreScale); }
+
+    std::vector<double> lineBounds;
+    std::vector<std::pair<double, int>> boundOrder;
+    std::vector<CandidateChoice> batch;
+
+    std::unique_ptr<LinePalette> screenPalette;
+    int screenFactor = 0;
+    std::vector<int> screenBlock;          // full-res pixel -> low-res pixel
+    std::vector<double> screenBlockWeight; // 1 / full-res pixels per low-res pixel
+    std::vector<double> screenPixelGain;   // full-res gains the map was built from
+    std::vector<double> screenGain;        // mean full-res gain per low-res pixel
+
+    std::vector<long long> batchMark; // commit serial that last changed each pixel
+    std::vector<int> sweptRow;        // nail -> row of sweepScores, -1 if not swept this round
+    std::vector<int> sweptNodes;
+    std::vector<long long> sweptStamps;
+    std::vector<double> sweepScores;
+    long long batchSerial = 0;
+
+    // Each worker scans a contiguous range of nails; reducing the per-worker
+    // winners in range order with a strict '>' keeps the lowest nail on ties,
+    // exactly like a serial scan.
+    template <typename Scorer>
+    CandidateChoice selectBest(const Scorer& scorer, int current, int nailCount, int minGap) {
+        workerBest.assign(pool->GetThreadCount(), CandidateChoice());
+        pool->ParallelFor(nailCount, [&](int begin, int end, int worker) {
+            CandidateChoice local;
+            for (int cand = begin; cand < end; cand++) {
+                if (!cache->IsEligible(current, cand, minGap)) continue;
+
+                double impr = scorer.Score(cache->GetLine(current, cand, workerScratch[worker]));
+                if (impr > local.improvement) {
+                    local.improvement = impr;
+                    local.nail = cand;
+                }
             }
+            workerBest[worker] = local;
+        });
+
+        CandidateChoice best;
+        for (const auto& choice : workerBest) {
+            if (choice.improvement > best.improvement) best = choice;
         }
+        return best;
     }
 
-public:
-    GreedyOptimizer(LinePalette* cache) : cache(cache) {}
+    // A committed line only changes the scores of lines crossing it, so most
+    // heap entries stay close to their true value. The top entry is rescored
+    // until a fresh one (stamp == commits) surfaces and that one is taken.
+    // This is exact while scores only fall; a pixel already darker than its
+    // target can make a crossing line score slightly better than its stale
+    // entry, so lazy selection may pick a near-best line instead of the best.
+    //
+    // A nail's heap is built by scoring all its lines on the first visit.
+    template <typename Scorer>
+    CandidateChoice selectLazy(const Scorer& scorer, int current, int nailCount, int minGap,
+                               int commits, SelectionStats& stats) {
+        auto& heap = lazyHeaps[current];
+        if (heap.empty()) {
+            candidateScores.assign(nailCount, 0.0);
+            pool->ParallelFor(nailCount, [&](int begin, int end, int worker) {
+                for (int cand = begin; cand < end; cand++) {
+                    if (!cache->IsEligible(current, cand, minGap)) continue;
+                    candidateScores[cand] = scorer.Score(cache->GetLine(current, cand, workerScratch[worker]));
+                }
+            });
+            for (int cand = 0; cand < nailCount; cand++) {
+                if (!cache->IsEligible(current, cand, minGap)) continue;
+                heap.push_back({ candidateScores[cand], cand, commits });
+                stats.scored++;
+            }
+            std::make_heap(heap.begin(), heap.end());
+            if (heap.empty()) return CandidateChoice();
+        } else {
+            while (heap.front().stamp != commits) {
+                std::pop_heap(heap.begin(), heap.end());
+                LazyCandidate& entry = heap.back();
+                entry.improvement = scorer.Score(cache->GetLine(current, entry.nail, workerScratch[0]));
+                entry.stamp = commits;
+                std::push_heap(heap.begin(), heap.end());
+                stats.scored++;
+                stats.skipped--;
+            }
+            stats.skipped += heap.size();
+        }
 
-    GenerationResult Optimize(const Image& target,
-                             const std::vector<Nail>& nails,
-                             const GenerationParameters& params,
-                             void (*progress)(int, int, const char*) = nullptr) {
+        CandidateChoice best;
+        best.nail = heap.front().nail;
+        best.improvement = heap.front().improvement;
+        return best;
+    }
+
+    template <typename Scorer>
+    void initIncremental(const Scorer& scorer) {
+        if (!inverseIndex) inverseIndex = std::make_unique<LineInverseIndex>(*cache);
+        pixelGains.resize(inverseIndex->GetPixelCount());
+        for (int p = 0; p < inverseIndex->GetPixelCount(); p++) {
+            pixelGains[p] = quantizeGain(scorer.PixelGain(p));
+        }
+
+        int nailCount = cache->GetNailCount();
+        lineScores.assign(cache->GetPairCount(), 0);
+        pool->ParallelForEach(nailCount, [&](int f, int worker) {
+            for (int t = f + 1; t < nailCount; t++) {
+                std::int64_t sum = 0;
+                for (int idx : cache->GetLine(f, t, workerScratch[worker])) sum += pixelGains[idx];
+                lineScores[cache->GetPairIndex(f, t)] = sum;
+            }
+        });
+    }
+
+    // Called after scorer.Commit(line): only pixels under the committed line
+    // changed gain, and each change is added to every line through that
+    // pixel. Workers own contiguous ranges of line ids and use the sorted
+    // per-pixel lists to find their part.
+    template <typename Scorer>
+    void updateIncremental(const Scorer& scorer, LineSpan line) {
+        changedPixels.clear();
+        for (int idx : line) {
+            std::int64_t gain = quantizeGain(scorer.PixelGain(idx));
+            if (gain != pixelGains[idx]) {
+                changedPixels.emplace_back(idx, gain - pixelGains[idx]);
+                pixelGains[idx] = gain;
+            }
+        }
+
+        pool->ParallelFor((int)cache->GetPairCount(), [&](int begin, int end, int) {
+            for (const auto& change : changedPixels) {
+                const std::int32_t* last = inverseIndex->LinesEnd(change.first);
+                const std::int32_t* id = std::lower_bound(inverseIndex->LinesBegin(change.first), last, begin);
+                for (; id != last && *id < end; ++id) lineScores[*id] += change.second;
+            }
+        });
+    }
+
+    CandidateChoice selectIncremental(int current, int nailCount, int minGap, double pixelScale) {
+        CandidateChoice best;
+        std::int64_t bestScore = 0;
+        for (int cand = 0; cand < nailCount; cand++) {
+            if (!cache->IsEligible(current, cand, minGap)) continue;
+            std::int64_t score = lineScores[cache->GetPairIndex(current, cand)];
+            if (best.nail < 0 || score > bestScore) {
+                bestScore = score;
+                best.nail = cand;
+            }
+        }
+        best.improvement = bestScore / kScoreScale * pixelScale;
+        return best;
+    }
+
+    // A line's Potential never grows as lines are committed, so the value
+    // from the last time it was scored stays an upper bound on its gain.
+    // Candidates are scored in descending bound order (lower nail first on
+    // equal bounds) until the next bound cannot beat the best line found,
+    // which gives exactly the exhaustive choice. Each batch holds one
+    // candidate per worker. Bounds carry a small slack against rounding
+    // differences between Potential and the SIMD gain kernels.
+    template <typename Scorer>
+    CandidateChoice selectBounded(const Scorer& scorer, int current, int nailCount, int minGap,
+                                  SelectionStats& stats) {
+        boundOrder.clear();
+        for (int cand = 0; cand < nailCount; cand++) {
+            if (!cache->IsEligible(current, cand, minGap)) continue;
+            boundOrder.emplace_back(lineBounds[cache->GetPairIndex(current, cand)], cand);
+        }
+        std::sort(boundOrder.begin(), boundOrder.end(), [](const auto& a, const auto& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+
+        auto canWin = [](double bound, int cand, const CandidateChoice& best) {
+            return best.nail < 0 || bound > best.improvement || (bound == best.improvement && cand < best.nail);
+        };
+
+        CandidateChoice best;
+        int threads = pool->GetThreadCount();
+        size_t next = 0;
+        while (next < boundOrder.size() && canWin(boundOrder[next].first, boundOrder[next].second, best)) {
+            size_t count = std::min(boundOrder.size() - next, (size_t)threads);
+            batch.assign(count, CandidateChoice());
+            pool->ParallelFor((int)count, [&](int begin, int end, int worker) {
+                for (int i = begin; i < end; i++) {
+                    int cand = boundOrder[next + i].second;
+                    LineSpan line = cache->GetLine(current, cand, workerScratch[worker]);
+                    batch[i].nail = cand;
+                    batch[i].improvement = scorer.Score(line);
+                    double potential = scorer.Potential(line);
+                    lineBounds[cache->GetPairIndex(current, cand)] = potential + potential * 1e-9 + 1e-12;
+                }
+            });
+            for (const auto& choice : batch) {
+                if (choice.improvement > best.improvement || best.nail < 0 ||
+                    (choice.improvement == best.improvement && choice.nail < best.nail)) {
+                    best = choice;
+                }
+            }
+            next += count;
+            stats.scored += count;
+        }
+        stats.skipped += boundOrder.size() - next;
+        return best;
+    }
+
+    // The screening map holds, per low-res pixel, the mean gain of the
+    // full-res pixels it covers; a low-res line's screening score is the sum
+    // of the map under it. The map is kept current from the committed lines'
+    // pixels, so it needs no rebuild between iterations.
+    template <typename Scorer>
+    void initScreening(const Scorer& scorer, int factor, int threads) {
+        int width = cache->GetWidth();
+        int height = cache->GetHeight();
+        factor = std::max(1, factor);
+        int lowWidth = std::max(1, width / factor);
+        int lowHeight = std::max(1, height / factor);
+        if (!screenPalette || screenFactor != factor) {
+            std::vector<Nail> lowNails = cache->GetNails();
+            for (auto& nail : lowNails) {
+                nail.x /= factor;
+                nail.y /= factor;
+            }
+            screenPalette = std::make_unique<LinePalette>(lowNails, lowWidth, lowHeight, threads);
+            screenFactor = factor;
+        }
+
+        screenBlock.resize(width * height);
+        screenPixelGain.resize(width * height);
+        screenBlockWeight.assign(lowWidth * lowHeight, 0.0);
+        screenGain.assign(lowWidth * lowHeight, 0.0);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int p = y * width + x;
+                int b = std::min(y / factor, lowHeight - 1) * lowWidth + std::min(x / factor, lowWidth - 1);
+                screenBlock[p] = b;
+                screenPixelGain[p] = scorer.PixelGain(p);
+                screenGain[b] += screenPixelGain[p];
+                screenBlockWeight[b] += 1.0;
+            }
+        }
+        for (size_t b = 0; b < screenGain.size(); b++) {
+            screenBlockWeight[b] = 1.0 / screenBlockWeight[b];
+            screenGain[b] *= screenBlockWeight[b];
+        }
+    }
+
+    template <typename Scorer>
+    void updateScreening(const Scorer& scorer, LineSpan line) {
+        for (int idx : line) {
+            double gain = scorer.PixelGain(idx);
+            int b = screenBlock[idx];
+            screenGain[b] += (gain - screenPixelGain[idx]) * screenBlockWeight[b];
+            screenPixelGain[idx] = gain;
+        }
+    }
+
+    // Ranks every candidate on the screening map and takes the best of the
+    // top k by exact score. On audit iterations the exhaustive winner is
+    // computed as well, only to measure how often screening misses it.
+    template <typename Scorer>
+    CandidateChoice selectScreened(const Scorer& scorer, int current, int nailCount, int minGap,
+                                   int topK, bool audit, SelectionStats& stats, ScreeningStats& screening) {
+        candidateScores.assign(nailCount, 0.0);
+        pool->ParallelFor(nailCount, [&](int begin, int end, int worker) {
+            for (int cand = begin; cand < end; cand++) {
+                if (!cache->IsEligible(current, cand, minGap)) continue;
+                double sum = 0.0;
+                for (int b : screenPalette->GetLine(current, cand, workerScratch[worker])) sum += screenGain[b];
+                candidateScores[cand] = sum;
+            }
+        });
+
+        boundOrder.clear();
+        for (int cand = 0; cand < nailCount; cand++) {
+            if (cache->IsEligible(current, cand, minGap)) boundOrder.emplace_back(candidateScores[cand], cand);
+        }
+        size_t k = std::min(boundOrder.size(), (size_t)std::max(1, topK));
+        std::partial_sort(boundOrder.begin(), boundOrder.begin() + k, boundOrder.end(), [](const auto& a, const auto& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+
+        batch.assign(k, CandidateChoice());
+        pool->ParallelFor((int)k, [&](int begin, int end, int worker) {
+            for (int i = begin; i < end; i++) {
+                batch[i].nail = boundOrder[i].second;
+                batch[i].improvement = scorer.Score(cache->GetLine(current, batch[i].nail, workerScratch[worker]));
+            }
+        });
+
+        CandidateChoice best;
+        for (const auto& choice : batch) {
+            if (best.nail < 0 || choice.improvement > best.improvement ||
+                (choice.improvement == best.improvement && choice.nail < best.nail)) {
+                best = choice;
+            }
+        }
+        stats.scored += k;
+        stats.skipped += boundOrder.size() - k;
+
+        if (audit && best.nail >= 0) {
+            CandidateChoice exact = selectBest(scorer, current, nailCount, minGap);
+            screening.audits++;
+            if (exact.nail != boundOrder[0].second) screening.lowResMisses++;
+            if (exact.nail != best.nail) {
+                screening.misses++;
+                screening.improvementLost += exact.improvement - best.improvement;
+            }
+        }
+        return best;
+    }
+
+    int nailPixel(int nail) const {
+        const Nail& n = cache->GetNails()[nail];
+        int x = (int)n.x, y = (int)n.y;
+        if (x < 0 || x >= cache->GetWidth() || y < 0 || y >= cache->GetHeight()) return -1;
+        return y * cache->GetWidth() + x;
+    }
+
+    // True if no pixel of the line changed after the sweep stamped `stamp`,
+    // not counting the two nail pixels (consecutive lines always meet there).
+    bool unchangedSince(LineSpan line, int from, int to, long long stamp) const {
+        int a = nailPixel(from), b = nailPixel(to);
+        for (int idx : line) {
+            if (batchMark[idx] > stamp && idx != a && idx != b) return false;
+        }
+        return true;
+    }
+
+    // One round of Batched mode. The thread walks up to batchMaxLines lines,
+    // sweeping a node only the first time the round reaches it. A swept
+    // score stays exact for every line whose pixels were not committed
+    // since the sweep, so revisiting a node costs no scoring. From each node
+    // the best unchanged line is taken, or the best one ending on an already
+    // swept node if it scores within batchQuality of it, which keeps the
+    // walk on nodes whose scores are known. Each chosen line is rescored
+    // before commit, since its nail pixels may have changed.
+    //
+    // Returns the number of lines committed, at most budget.
+    template <typename Scorer>
+    int commitBatch(Scorer& scorer, int& current, int nailCount, int minGap, int eligible, int budget,
+                    const GenerationParameters& params, GenerationResult& result) {
+        int size = cache->GetWidth() * cache->GetHeight();
+        if ((int)batchMark.size() != size) batchMark.assign(size, 0);
+        if ((int)sweptRow.size() != nailCount) sweptRow.assign(nailCount, -1);
+        sweptNodes.clear();
+        sweptStamps.clear();
+
+        int added = 0;
+        int node = current;
+        budget = std::min(budget, std::max(1, params.batchMaxLines));
+        while (added < budget) {
+            if (sweptRow[node] < 0) {
+                int row = (int)sweptNodes.size();
+                sweptRow[node] = row;
+                sweptNodes.push_back(node);
+                sweptStamps.push_back(batchSerial);
+                sweepScores.resize(sweptNodes.size() * nailCount);
+                double* out = sweepScores.data() + (size_t)row * nailCount;
+                pool->ParallelFor(nailCount, [&](int begin, int end, int worker) {
+                    for (int cand = begin; cand < end; cand++) {
+                        out[cand] = cache->IsEligible(node, cand, minGap)
+                            ? scorer.Score(cache->GetLine(node, cand, workerScratch[worker])) : -1.0;
+                    }
+                });
+                result.selection.sweeps++;
+                result.selection.scored += eligible;
+            } else {
+                result.selection.skipped += eligible;
+            }
+
+            const double* scores = sweepScores.data() + (size_t)sweptRow[node] * nailCount;
+            long long stamp = sweptStamps[sweptRow[node]];
+            boundOrder.clear();
+            for (int cand = 0; cand < nailCount; cand++) {
+                if (scores[cand] > params.improvementThreshold) boundOrder.emplace_back(scores[cand], cand);
+            }
+            std::sort(boundOrder.begin(), boundOrder.end(), [](const auto& a, const auto& b) {
+                return a.first != b.first ? a.first > b.first : a.second < b.second;
+            });
+
+            // Stale scores of changed lines are rescored on the way down; the
+            // walk stops once stale scores fall below what can still be taken.
+            CandidateChoice best, bestSwept;
+            for (const auto& entry : boundOrder) {
+                if (best.nail >= 0 && entry.first < params.batchQuality * best.improvement) break;
+                int cand = entry.second;
+                LineSpan line = cache->GetLine(node, cand, workerScratch[0]);
+                double impr = entry.first;
+                if (!unchangedSince(line, node, cand, stamp)) {
+                    impr = scorer.Score(line);
+                    result.selection.scored++;
+                }
+                if (impr > best.improvement) best = { cand, impr };
+                if (sweptRow[cand] >= 0 && impr > bestSwept.improvement) bestSwept = { cand, impr };
+            }
+            if (bestSwept.nail >= 0 && bestSwept.improvement >= params.batchQuality * best.improvement) best = bestSwept;
+            if (best.nail < 0) break;
+
+            LineSpan line = cache->GetLine(node, best.nail, workerScratch[0]);
+            double impr = scorer.Score(line);
+            result.selection.scored++;
+            if (impr <= params.improvementThreshold) break;
+
+            scorer.Commit(line);
+            result.selection.iterations++;
+            batchSerial++;
+            for (int idx : line) batchMark[idx] = batchSerial;
+            result.lineSequence.emplace_back(node, best.nail, result.lineSequence.size());
+            recentImprovements.push_back({(int)result.lineSequence.size(), impr});
+            if (recentImprovements.size() > 100) recentImprovements.pop_front();
+            node = best.nail;
+            added++;
+        }
+
+        for (int n : sweptNodes) sweptRow[n] = -1;
+        current = node;
+        return added;
+    }
+
+    template <typename Scorer>
+    GenerationResult runGreedy(Scorer& scorer,
+                               const Image& target,
+                               const std::vector<Nail>& nails,
+                               const GenerationParameters& params,
+                               int minGap,
+                               const OptimizerState& initial,
+                               void (*progress)(int, int, const char*)) {
         GenerationResult result;
         result.nails = nails;
-        int size = target.getWidth();
-        Image intensity(size, size);
-        intensity.fill(0.0);
-        int current = 0;
+        result.lineSequence = initial.lineSequence;
+        int current = initial.currentNail;
+        if (initial.intensity.getSize() == target.getSize()) scorer.Reset(initial.intensity);
 
         auto startTime = std::chrono::high_resolution_clock::now();
 
-        int minGap = (params.stage == 1) ? 16 : 8;
-        double lineAlpha = (params.stage == 1) ? 0.05 : 0.1;
         int maxIterations = params.maxIterations;
+        int nailCount = (int)nails.size();
+        workerScratch.resize(pool.Get(params.threads).GetThreadCount());
+
+        SelectionMode mode = params.selectionMode;
+        if (mode == SelectionMode::Lazy) lazyHeaps.assign(nailCount, std::vector<LazyCandidate>());
+        if (mode == SelectionMode::Incremental) initIncremental(scorer);
+        if (mode == SelectionMode::BranchAndBound) {
+            lineBounds.assign(cache->GetPairCount(), std::numeric_limits<double>::infinity());
+        }
+        if (mode == SelectionMode::Screened) initScreening(scorer, params.screeningFactor, params.threads);
+        int eligible = 0;
+        for (int cand = 0; cand < nailCount; cand++) {
+            if (cache->IsEligible(0, cand, minGap)) eligible++;
+        }
 
         for (int iter = 0; iter < maxIterations; iter++) {
-            int best = -1;
-            double bestImpr = -1.0;
-            Image bestIntensity(size, size);
-            bestIntensity.fill(0.0);
-
-            for (int cand = 0; cand < (int)nails.size(); cand++) {
-                if (cand == current) continue;
-                int d = std::abs(cand - current);
-                d = std::min(d, (int)nails.size() - d);
-                if (d < minGap) continue;
-
-                Image temp = intensity;
-                ApplyLineWithAlpha(temp, current, cand, lineAlpha);
-                double impr = Algorithms::CalculateImprovement(target, intensity, temp);
-                if (impr > bestImpr) {
-                    bestImpr = impr;
-                    best = cand;
-                    bestIntensity = temp;
+            CandidateChoice choice;
+            if (mode == SelectionMode::Batched) {
+                int added = commitBatch(scorer, current, nailCount, minGap, eligible, maxIterations - iter,
+                                        params, result);
+                if (added == 0) break;
+                if (progress && (iter + added) / 100 != iter / 100) {
+                    progress(iter + added, maxIterations, "Optimizing...");
                 }
+                iter += added - 1;
+                continue;
+            }
+            result.selection.iterations++;
+            if (mode == SelectionMode::Lazy) {
+                choice = selectLazy(scorer, current, nailCount, minGap, iter, result.selection);
+            } else if (mode == SelectionMode::Incremental) {
+                choice = selectIncremental(current, nailCount, minGap, scorer.GetPixelScale());
+                result.selection.skipped += eligible;
+            } else if (mode == SelectionMode::BranchAndBound) {
+                choice = selectBounded(scorer, current, nailCount, minGap, result.selection);
+            } else if (mode == SelectionMode::Screened) {
+                bool audit = params.screeningAuditInterval > 0 && iter % params.screeningAuditInterval == 0;
+                choice = selectScreened(scorer, current, nailCount, minGap, params.screeningTopK, audit,
+                                        result.selection, result.screening);
+            } else {
+                choice = selectBest(scorer, current, nailCount, minGap);
+                result.selection.scored += eligible;
             }
+            int best = choice.nail;
+            double bestImpr = choice.improvement;
 
-            if (best == -1 || bestImpr <= 0.005) break;
-            intensity = bestIntensity;
+            if (best == -1 || bestImpr <= params.improvementThreshold) break;
+            LineSpan line = cache->GetLine(current, best, workerScratch[0]);
+            scorer.Commit(line);
+            if (mode == SelectionMode::Incremental) updateIncremental(scorer, line);
+            if (mode == SelectionMode::Screened) updateScreening(scorer, line);
             result.lineSequence.emplace_back(current, best, result.lineSequence.size());
             current = best;
             recentImprovements.push_back({iter, bestImpr});
@@ -136,12 +1005,52 @@ public:
 
         auto endTime = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
-        result.renderedImage = intensity;
+        Image intensity = scorer.GetIntensity();
         result.metrics.setMse(Algorithms::CalculateMSE(target, intensity));
         result.metrics.setRmse(Algorithms::CalculateRMSE(target, intensity));
         result.metrics.setCoveragePercent(Algorithms::CalculateCoveragePercent(intensity));
         result.metrics.setTotalLines(result.lineSequence.size());
         result.metrics.setProcessingTimeMs(duration.count());
+        result.renderedImage = std::move(intensity);
         return result;
     }
+
+    // Stages draw with different alphas, so a replay needs each line's own;
+    // they are only recorded while every earlier line's alpha is known.
+    static GenerationResult recordAlphas(GenerationResult result, const OptimizerState& initial, double lineAlpha) {
+        if (initial.lineAlphas.size() == initial.lineSequence.size()) {
+            result.lineAlphas = initial.lineAlphas;
+            result.lineAlphas.resize(result.lineSequence.size(), lineAlpha);
+        }
+        return result;
+    }
+
+public:
+    GreedyOptimizer(LinePalette* cache) : cache(cache) {}
+
+    GenerationResult Optimize(const Image& target,
+                             const std::vector<Nail>& nails,
+                             const GenerationParameters& params,
+                             void (*progress)(int, int, const char*) = nullptr) {
+        return Optimize(target, nails, params, OptimizerState(), progress);
+    }
+
+    // Continues from initial: its canvas, current nail and line sequence.
+    // The returned sequence is initial.lineSequence followed by the new lines.
+    GenerationResult Optimize(const Image& target,
+                             const std::vector<Nail>& nails,
+                             const GenerationParameters& params,
+                             const OptimizerState& initial,
+                             void (*progress)(int, int, const char*) = nullptr) {
+        int minGap = params.minGap;
+        double lineAlpha = params.lineAlpha;
+
+        if (params.intensityModel == IntensityModel::HitCount) {
+            HitCountScorer scorer(target, lineAlpha, params.simdLevel);
+            return recordAlphas(runGreedy(scorer, target, nails, params, minGap, initial, progress), initial, lineAlpha);
+        }
+
+        ResidualScorer scorer(target, lineAlpha, params.simdLevel);
+        return recordAlphas(runGreedy(scorer, target, nails, params, minGap, initial, progress), initial, lineAlpha);
+    }
 };
\ No newline at end of file
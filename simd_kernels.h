@@ -0,0 +1,230 @@
+#pragma once
+#include "models.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define STRINGART_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define STRINGART_TARGET(isa)
+#else
+#include <cpuid.h>
+#define STRINGART_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// Line-scoring kernels. Each one sums the gain of drawing one more line over
+// the pixel indices of a palette line; the vector versions gather the
+// per-pixel state with the widest instructions the CPU offers. Kernels only
+// differ from the scalar reference in summation order.
+namespace ScoringKernels {
+
+	// Byte arrays read by the 32-bit gathers must have this many readable
+	// bytes past the last pixel.
+	constexpr int kGatherPadding = 3;
+
+	typedef double (*ResidualGainFn)(const int* idx, int count,
+		const double* residual, const double* intensity, double lineAlpha);
+	typedef double (*HitCountGainFn)(const int* idx, int count,
+		const unsigned char* targetLevel, const unsigned char* hits,
+		const double* gainTable, int stride);
+
+	struct KernelSet {
+		SimdLevel level;
+		const char* name;
+		ResidualGainFn residualGain;
+		HitCountGainFn hitCountGain;
+	};
+
+	// gain = r^2 - (r + d)^2 with d = 255 * alpha * (1 - intensity)
+	inline double ResidualGainScalar(const int* idx, int count,
+		const double* residual, const double* intensity, double lineAlpha) {
+		double scale = 255.0 * lineAlpha;
+		double gain = 0.0;
+		for (int i = 0; i < count; i++) {
+			double r = residual[idx[i]];
+			double d = scale * (1.0 - intensity[idx[i]]);
+			gain -= d * (2.0 * r + d);
+		}
+		return gain;
+	}
+
+	inline double HitCountGainScalar(const int* idx, int count,
+		const unsigned char* targetLevel, const unsigned char* hits,
+		const double* gainTable, int stride) {
+		double gain = 0.0;
+		for (int i = 0; i < count; i++) {
+			gain += gainTable[targetLevel[idx[i]] * stride + hits[idx[i]]];
+		}
+		return gain;
+	}
+
+#ifdef STRINGART_X86
+
+	STRINGART_TARGET("avx2")
+	inline double ResidualGainAvx2(const int* idx, int count,
+		const double* residual, const double* intensity, double lineAlpha) {
+		__m256d scale = _mm256_set1_pd(255.0 * lineAlpha);
+		__m256d one = _mm256_set1_pd(1.0);
+		__m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+		__m256d acc = _mm256_setzero_pd();
+		int i = 0;
+		for (; i + 4 <= count; i += 4) {
+			__m128i vi = _mm_loadu_si128((const __m128i*)(idx + i));
+			__m256d r = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), residual, vi, all, 8);
+			__m256d v = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), intensity, vi, all, 8);
+			__m256d d = _mm256_mul_pd(scale, _mm256_sub_pd(one, v));
+			acc = _mm256_sub_pd(acc, _mm256_mul_pd(d, _mm256_add_pd(_mm256_add_pd(r, r), d)));
+		}
+		double lanes[4];
+		_mm256_storeu_pd(lanes, acc);
+		return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3])
+			+ ResidualGainScalar(idx + i, count - i, residual, intensity, lineAlpha);
+	}
+
+	STRINGART_TARGET("avx2")
+	inline double HitCountGainAvx2(const int* idx, int count,
+		const unsigned char* targetLevel, const unsigned char* hits,
+		const double* gainTable, int stride) {
+		__m256i byteMask = _mm256_set1_epi32(0xFF);
+		__m256i strideV = _mm256_set1_epi32(stride);
+		__m256i allLanes = _mm256_set1_epi32(-1);
+		__m256d all = _mm256_castsi256_pd(allLanes);
+		__m256d acc = _mm256_setzero_pd();
+		int i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m256i vi = _mm256_loadu_si256((const __m256i*)(idx + i));
+			__m256i t = _mm256_and_si256(_mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+				(const int*)targetLevel, vi, allLanes, 1), byteMask);
+			__m256i h = _mm256_and_si256(_mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+				(const int*)hits, vi, allLanes, 1), byteMask);
+			__m256i key = _mm256_add_epi32(_mm256_mullo_epi32(t, strideV), h);
+			acc = _mm256_add_pd(acc, _mm256_mask_i32gather_pd(_mm256_setzero_pd(), gainTable,
+				_mm256_castsi256_si128(key), all, 8));
+			acc = _mm256_add_pd(acc, _mm256_mask_i32gather_pd(_mm256_setzero_pd(), gainTable,
+				_mm256_extracti128_si256(key, 1), all, 8));
+		}
+		double lanes[4];
+		_mm256_storeu_pd(lanes, acc);
+		return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3])
+			+ HitCountGainScalar(idx + i, count - i, targetLevel, hits, gainTable, stride);
+	}
+
+	STRINGART_TARGET("avx512f")
+	inline double ResidualGainAvx512(const int* idx, int count,
+		const double* residual, const double* intensity, double lineAlpha) {
+		__m512d scale = _mm512_set1_pd(255.0 * lineAlpha);
+		__m512d one = _mm512_set1_pd(1.0);
+		__m512d acc = _mm512_setzero_pd();
+		int i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m256i vi = _mm256_loadu_si256((const __m256i*)(idx + i));
+			__m512d r = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xFF, vi, residual, 8);
+			__m512d v = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xFF, vi, intensity, 8);
+			__m512d d = _mm512_mul_pd(scale, _mm512_sub_pd(one, v));
+			acc = _mm512_sub_pd(acc, _mm512_mul_pd(d, _mm512_add_pd(_mm512_add_pd(r, r), d)));
+		}
+		double lanes[8];
+		_mm512_storeu_pd(lanes, acc);
+		return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]))
+			+ ResidualGainScalar(idx + i, count - i, residual, intensity, lineAlpha);
+	}
+
+	STRINGART_TARGET("avx512f")
+	inline double HitCountGainAvx512(const int* idx, int count,
+		const unsigned char* targetLevel, const unsigned char* hits,
+		const double* gainTable, int stride) {
+		__m512i byteMask = _mm512_set1_epi32(0xFF);
+		__m512i strideV = _mm512_set1_epi32(stride);
+		__m512d acc = _mm512_setzero_pd();
+		int i = 0;
+		for (; i + 16 <= count; i += 16) {
+			__m512i vi = _mm512_loadu_si512((const void*)(idx + i));
+			__m512i t = _mm512_and_si512(_mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF,
+				vi, (const void*)targetLevel, 1), byteMask);
+			__m512i h = _mm512_and_si512(_mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF,
+				vi, (const void*)hits, 1), byteMask);
+			__m512i key = _mm512_add_epi32(_mm512_mullo_epi32(t, strideV), h);
+			acc = _mm512_add_pd(acc, _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xFF,
+				_mm512_maskz_extracti64x4_epi64(0xF, key, 0), gainTable, 8));
+			acc = _mm512_add_pd(acc, _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xFF,
+				_mm512_maskz_extracti64x4_epi64(0xF, key, 1), gainTable, 8));
+		}
+		double lanes[8];
+		_mm512_storeu_pd(lanes, acc);
+		return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]))
+			+ HitCountGainScalar(idx + i, count - i, targetLevel, hits, gainTable, stride);
+	}
+
+	inline void CpuId(int leaf, int subleaf, unsigned int regs[4]) {
+#if defined(_MSC_VER)
+		int out[4];
+		__cpuidex(out, leaf, subleaf);
+		for (int i = 0; i < 4; i++) regs[i] = (unsigned int)out[i];
+#else
+		__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	}
+
+	inline unsigned long long ReadXcr0() {
+#if defined(_MSC_VER)
+		return _xgetbv(0);
+#else
+		unsigned int lo, hi;
+		__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		return ((unsigned long long)hi << 32) | lo;
+#endif
+	}
+
+	// Highest level both the CPU and the OS (saved register state) support.
+	inline SimdLevel DetectSimdLevel() {
+		unsigned int regs[4];
+		CpuId(0, 0, regs);
+		unsigned int maxLeaf = regs[0];
+		if (maxLeaf < 1) return SimdLevel::Scalar;
+
+		CpuId(1, 0, regs);
+		bool osxsave = (regs[2] >> 27) & 1;
+		bool avx = (regs[2] >> 28) & 1;
+		if (!osxsave || !avx || maxLeaf < 7) return SimdLevel::Scalar;
+
+		unsigned long long xcr0 = ReadXcr0();
+		if ((xcr0 & 0x6) != 0x6) return SimdLevel::Scalar;
+
+		CpuId(7, 0, regs);
+		bool avx2 = (regs[1] >> 5) & 1;
+		bool avx512f = (regs[1] >> 16) & 1;
+		if (avx512f && (xcr0 & 0xE6) == 0xE6) return SimdLevel::Avx512;
+		if (avx2) return SimdLevel::Avx2;
+		return SimdLevel::Scalar;
+	}
+
+#else
+
+	inline SimdLevel DetectSimdLevel() {
+		return SimdLevel::Scalar;
+	}
+
+#endif
+
+	inline KernelSet GetKernelSet(SimdLevel level) {
+		switch (level) {
+#ifdef STRINGART_X86
+		case SimdLevel::Avx512: return { level, "AVX-512", ResidualGainAvx512, HitCountGainAvx512 };
+		case SimdLevel::Avx2: return { level, "AVX2", ResidualGainAvx2, HitCountGainAvx2 };
+#endif
+		default: return { SimdLevel::Scalar, "scalar", ResidualGainScalar, HitCountGainScalar };
+		}
+	}
+
+	// The one place the optimizer picks its kernels. Auto uses the best level
+	// detected at runtime; an explicit request is capped to what the CPU has.
+	inline KernelSet SelectKernels(SimdLevel requested = SimdLevel::Auto) {
+		static const SimdLevel detected = DetectSimdLevel();
+		if (requested == SimdLevel::Auto || (int)requested > (int)detected) {
+			return GetKernelSet(detected);
+		}
+		return GetKernelSet(requested);
+	}
+
+};
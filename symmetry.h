@@ -0,0 +1,32 @@
+#pragma once
+
+// The 8 symmetries of a square raster (dihedral group D4). With nails spaced
+// evenly on a centred circle and a nail count divisible by 4, each of them
+// maps nails onto nails, so a line's pixels can be derived from its image
+// under the group instead of being stored.
+//
+// Element g applies a reflection across the horizontal axis when (g & 4) is
+// set, then (g & 3) quarter turns.
+namespace Symmetry {
+
+	constexpr int kGroupSize = 8;
+
+	inline int MapNail(int g, int nail, int nailCount) {
+		if (g & 4) nail = (nailCount - nail) % nailCount;
+		return (nail + (g & 3) * (nailCount / 4)) % nailCount;
+	}
+
+	inline void MapPixel(int g, int& x, int& y, int size) {
+		if (g & 4) y = size - 1 - y;
+		for (int k = 0; k < (g & 3); k++) {
+			int t = x;
+			x = size - 1 - y;
+			y = t;
+		}
+	}
+
+	inline bool Applies(int nailCount, int width, int height) {
+		return width == height && nailCount >= 4 && nailCount % 4 == 0;
+	}
+
+};
@@ -0,0 +1,121 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+// Fixed set of worker threads that stay alive between jobs. The calling
+// thread takes part in every job as worker 0, so a pool of one thread runs
+// everything inline.
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const std::function<void(int)>* job = nullptr;
+    long long generation = 0;
+    int pending = 0;
+    bool stopping = false;
+    int threadCount;
+
+    void workerLoop(int worker) {
+        long long seen = 0;
+        while (true) {
+            const std::function<void(int)>* task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                task = job;
+            }
+
+            (*task)(worker);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0) finished.notify_one();
+        }
+    }
+
+public:
+    explicit ThreadPool(int threads) {
+        if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+        threadCount = std::max(1, threads);
+        for (int i = 1; i < threadCount; i++) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    int GetThreadCount() const { return threadCount; }
+
+    // Runs task(worker) once on every worker and blocks until all return.
+    void Run(const std::function<void(int)>& task) {
+        if (threadCount == 1) {
+            task(0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &task;
+            pending = threadCount - 1;
+            generation++;
+        }
+        wake.notify_all();
+
+        task(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return pending == 0; });
+    }
+
+    // Splits [0, count) into one contiguous chunk per worker, in worker order.
+    void ParallelFor(int count, const std::function<void(int, int, int)>& body) {
+        Run([&](int worker) {
+            int begin = (int)((long long)count * worker / threadCount);
+            int end = (int)((long long)count * (worker + 1) / threadCount);
+            if (begin < end) body(begin, end, worker);
+        });
+    }
+
+    // Hands out indices in [0, count) one at a time, for items of uneven cost.
+    void ParallelForEach(int count, const std::function<void(int, int)>& body) {
+        std::atomic<int> next(0);
+        Run([&](int worker) {
+            for (int i = next++; i < count; i = next++) body(i, worker);
+        });
+    }
+};
+
+// A ThreadPool created on first use and rebuilt only when a run asks for a
+// different thread count, so an optimizer keeps its workers across runs.
+// threads <= 0 means one per hardware thread.
+class ReusableThreadPool {
+private:
+    std::unique_ptr<ThreadPool> pool;
+
+public:
+    ThreadPool& Get(int threads) {
+        if (threads <= 0) threads = std::max(1, (int)std::thread::hardware_concurrency());
+        if (!pool || pool->GetThreadCount() != threads) pool = std::make_unique<ThreadPool>(threads);
+        return *pool;
+    }
+
+    ThreadPool* operator->() const { return pool.get(); }
+};
@@ -6,21 +6,30 @@
 #include <filesystem>
 #include <chrono>
 #include <iomanip>
-#include <sstream>
+#include <string_view>
+#include <charconv>
 #include <cstdlib>
+#include <cstdio>
+#include <csignal>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <memory>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+#include "mapped_file.h"
+#include "services.h"
 
 namespace fs = std::filesystem;
 
-struct Nail {
-    int id;
-    double x, y;
-    double angle;
-    
-    Nail(int id = 0, double x = 0, double y = 0, double angle = 0)
-        : id(id), x(x), y(y), angle(angle) {}
+enum class FrameOutput {
+    Png,         // one PNG per frame, encoded by ffmpeg afterwards
+    PngSegments, // PNG frames, segments of the sequence rendered in parallel
+    Y4mFile,     // raw grayscale YUV4MPEG2 stream written to the output file
+    Y4mPipe      // the same stream piped into ffmpeg's stdin
 };
 
 struct GenerationConfig {
@@ -33,180 +42,523 @@ struct GenerationConfig {
     int fps = 30;
     bool deleteFramesAfter = true;
     std::string ffmpegPath = "ffmpeg";
+    std::string paletteCacheDirectory = "palette_cache";
+    FrameOutput frameOutput = FrameOutput::Png;
+    int encodeThreads = 0; // PNG encoders / segment renderers, 0 = one per hardware thread
 };
 
-std::vector<Nail> GenerateNails(int count, double centerX, double centerY, double radius) {
-    std::vector<Nail> nails;
-    double angleStep = 360.0 / count;
-    for (int i = 0; i < count; i++) {
-        double angle = i * angleStep;
-        double radians = angle * std::acos(-1.0) / 180.0;
-        double x = centerX + radius * std::cos(radians);
-        double y = centerY + radius * std::sin(radians);
-        nails.emplace_back(i, x, y, angle);
-    }
-    return nails;
-}
+// Reads result.json straight out of a read-only mapping in one pass; numbers
+// are converted in place with std::from_chars, so nothing is copied.
+class SimpleJsonParser {
+private:
+    const char* begin = nullptr;
+    const char* cur = nullptr;
+    const char* end = nullptr;
+    std::string error;
+
+    void SkipWhitespace() {
+        while (cur < end && (*cur == ' ' || *cur == '\n' || *cur == '\r' || *cur == '\t')) cur++;
+    }
 
-std::vector<int> BresenhamLine(int x0, int y0, int x1, int y1, int width, int height) {
-    std::vector<int> pixels;
-    int dx = std::abs(x1 - x0);
-    int dy = std::abs(y1 - y0);
-    int sx = (x0 < x1) ? 1 : -1;
-    int sy = (y0 < y1) ? 1 : -1;
-    int err = dx - dy;
-    int x = x0, y = y0;
-    
-    while (true) {
-        if (x >= 0 && x < width && y >= 0 && y < height) {
-            pixels.push_back(y * width + x);
+    bool Expect(char c) {
+        SkipWhitespace();
+        if (cur < end && *cur == c) {
+            cur++;
+            return true;
         }
-        
-        if (x == x1 && y == y1) break;
-        
-        int e2 = 2 * err;
-        if (e2 > -dy) { err -= dy; x += sx; }
-        if (e2 < dx) { err += dx; y += sy; }
+        error = std::string("expected '") + c + "' at offset " + std::to_string(Offset());
+        return false;
     }
-    
-    return pixels;
-}
 
-class SimpleJsonParser {
-private:
-    std::vector<int> ParseArray(const std::string& arrayStr) {
-        std::vector<int> result;
-        std::string cleaned = arrayStr;
-        
-        if (cleaned.front() == '[') cleaned = cleaned.substr(1);
-        if (cleaned.back() == ']') cleaned = cleaned.substr(0, cleaned.length() - 1);
-        
-        std::stringstream ss(cleaned);
-        std::string token;
-        while (std::getline(ss, token, ',')) {
-            result.push_back(std::stoi(token));
+    bool ParseString(std::string_view& out) {
+        if (!Expect('"')) return false;
+        const char* start = cur;
+        while (cur < end && *cur != '"') {
+            if (*cur == '\\') cur++;
+            cur++;
         }
-        return result;
+        if (cur >= end) {
+            error = "unterminated string";
+            return false;
+        }
+        out = std::string_view(start, cur - start);
+        cur++;
+        return true;
     }
-    
-    int ParseInt(const std::string& str) {
-        return std::stoi(str);
+
+    bool ParseInt(int& out) {
+        SkipWhitespace();
+        auto res = std::from_chars(cur, end, out);
+        if (res.ec != std::errc()) {
+            error = "expected integer at offset " + std::to_string(Offset());
+            return false;
+        }
+        cur = res.ptr;
+        return true;
     }
-    
-public:
-    int nailCount = 0;
-    int totalLines = 0;
-    std::vector<int> threadSequence;
-    
-    bool Load(const std::string& path) {
-        try {
-            std::ifstream file(path);
-            if (!file.is_open()) {
-                std::cerr << "ERROR: Cannot open JSON file: " << path << std::endl;
-                return false;
+
+    bool ParseDouble(double& out) {
+        SkipWhitespace();
+        auto res = std::from_chars(cur, end, out);
+        if (res.ec != std::errc()) {
+            error = "expected number at offset " + std::to_string(Offset());
+            return false;
+        }
+        cur = res.ptr;
+        return true;
+    }
+
+    bool ParseValue(int& out) { return ParseInt(out); }
+    bool ParseValue(double& out) { return ParseDouble(out); }
+
+    template <typename T>
+    bool ParseArray(std::vector<T>& out) {
+        if (!Expect('[')) return false;
+        SkipWhitespace();
+        if (cur < end && *cur == ']') {
+            cur++;
+            return true;
+        }
+        while (true) {
+            T value;
+            if (!ParseValue(value)) return false;
+            out.push_back(value);
+            SkipWhitespace();
+            if (cur < end && *cur == ',') {
+                cur++;
+                continue;
             }
-            
-            std::string line;
-            std::string content;
-            while (std::getline(file, line)) {
-                content += line;
+            return Expect(']');
+        }
+    }
+
+    // Skips a value of a key we do not use.
+    bool SkipValue() {
+        SkipWhitespace();
+        if (cur < end && *cur == '"') {
+            std::string_view ignored;
+            return ParseString(ignored);
+        }
+        int depth = 0;
+        while (cur < end) {
+            char c = *cur;
+            if (c == '"') {
+                std::string_view ignored;
+                if (!ParseString(ignored)) return false;
+                continue;
             }
-            file.close();
-            
-            size_t nailPos = content.find("\"nail_count\"");
-            if (nailPos != std::string::npos) {
-                size_t colonPos = content.find(":", nailPos);
-                size_t commaPos = content.find(",", colonPos);
-                std::string nailStr = content.substr(colonPos + 1, commaPos - colonPos - 1);
-                nailCount = ParseInt(nailStr);
+            if (c == '[' || c == '{') depth++;
+            else if (c == ']' || c == '}') {
+                if (depth == 0) return true;
+                depth--;
+            } else if (c == ',' && depth == 0) {
+                return true;
             }
-            
-            size_t linesPos = content.find("\"total_lines\"");
-            if (linesPos != std::string::npos) {
-                size_t colonPos = content.find(":", linesPos);
-                size_t commaPos = content.find(",", colonPos);
-                std::string linesStr = content.substr(colonPos + 1, commaPos - colonPos - 1);
-                totalLines = ParseInt(linesStr);
+            cur++;
+        }
+        return true;
+    }
+
+    size_t Offset() const { return (size_t)(cur - begin); }
+
+    bool ParseDocument() {
+        if (!Expect('{')) return false;
+        while (true) {
+            SkipWhitespace();
+            if (cur < end && *cur == '}') return true;
+
+            std::string_view key;
+            if (!ParseString(key) || !Expect(':')) return false;
+
+            bool ok;
+            if (key == "nail_count") {
+                ok = ParseInt(nailCount);
+            } else if (key == "total_lines") {
+                ok = ParseInt(totalLines);
+                if (ok && totalLines > 0) threadSequence.reserve((size_t)totalLines + 1);
+            } else if (key == "thread_sequence") {
+                ok = ParseArray(threadSequence);
+            } else if (key == "line_alphas") {
+                ok = ParseArray(lineAlphas);
+            } else {
+                ok = SkipValue();
             }
-            
-            size_t seqPos = content.find("\"thread_sequence\"");
-            if (seqPos != std::string::npos) {
-                size_t arrayStart = content.find("[", seqPos);
-                size_t arrayEnd = content.rfind("]");
-                if (arrayStart != std::string::npos && arrayEnd != std::string::npos) {
-                    std::string arrayStr = content.substr(arrayStart, arrayEnd - arrayStart + 1);
-                    threadSequence = ParseArray(arrayStr);
-                }
+            if (!ok) return false;
+
+            SkipWhitespace();
+            if (cur < end && *cur == ',') {
+                cur++;
+                continue;
             }
-            
-            std::cout << "✓ Loaded JSON:" << std::endl;
-            std::cout << "  - Nails: " << nailCount << std::endl;
-            std::cout << "  - Total lines: " << totalLines << std::endl;
-            std::cout << "  - Thread sequence length: " << threadSequence.size() << std::endl;
-            
-            return true;
-        } catch (const std::exception& ex) {
-            std::cerr << "ERROR: JSON parse failed: " << ex.what() << std::endl;
+            return Expect('}');
+        }
+    }
+
+public:
+    int nailCount = 0;
+    int totalLines = 0;
+    std::vector<int> threadSequence;
+    std::vector<double> lineAlphas; // one per line; empty in files from older versions
+
+    bool Load(const std::string& path) {
+        MappedFile file;
+        if (!file.Open(path)) {
+            std::cerr << "ERROR: Cannot open JSON file: " << path << std::endl;
+            return false;
+        }
+
+        begin = cur = file.data();
+        end = begin + file.size();
+        threadSequence.clear();
+        lineAlphas.clear();
+        if (!ParseDocument()) {
+            std::cerr << "ERROR: JSON parse failed: " << error << std::endl;
+            return false;
+        }
+        if (!lineAlphas.empty() && lineAlphas.size() + 1 != threadSequence.size()) {
+            std::cerr << "ERROR: line_alphas has " << lineAlphas.size() << " entries for "
+                      << (threadSequence.empty() ? 0 : threadSequence.size() - 1) << " lines" << std::endl;
             return false;
         }
+
+        std::cout << "✓ Loaded JSON:" << std::endl;
+        std::cout << "  - Nails: " << nailCount << std::endl;
+        std::cout << "  - Total lines: " << totalLines << std::endl;
+        std::cout << "  - Thread sequence length: " << threadSequence.size() << std::endl;
+        std::cout << "  - Line alphas: " << (lineAlphas.empty() ? "not stored" : "per line") << std::endl;
+
+        return true;
     }
 };
 
 class VideoFrameGenerator {
 private:
-    std::vector<Nail> nails;
+    const LinePalette* palette;
+    LineScratch scratch;
     std::vector<double> intensity;
     int resolution;
     double lineAlpha;
     std::string outputDir;
     
 public:
-    VideoFrameGenerator(int resolution, double lineAlpha, const std::string& outputDir)
-        : resolution(resolution), lineAlpha(lineAlpha), outputDir(outputDir) {
+    VideoFrameGenerator(const LinePalette* palette, double lineAlpha, const std::string& outputDir)
+        : palette(palette), resolution(palette->GetWidth()), lineAlpha(lineAlpha), outputDir(outputDir) {
         intensity.resize(resolution * resolution, 0.0);
     }
     
-    void SetNails(const std::vector<Nail>& nails_) {
-        nails = nails_;
+    void ApplyLineWithAlpha(int fromNail, int toNail) {
+        ApplyLineWithAlpha(fromNail, toNail, lineAlpha);
+    }
+
+    void ApplyLineWithAlpha(int fromNail, int toNail, double alpha) {
+        for (int idx : palette->GetLine(fromNail, toNail, scratch)) {
+            intensity[idx] = intensity[idx] * (1.0 - alpha) + alpha;
+        }
     }
     
-    void ApplyLineWithAlpha(int fromNail, int toNail) {
-        auto pixels = BresenhamLine(
-            (int)nails[fromNail].x, (int)nails[fromNail].y,
-            (int)nails[toNail].x, (int)nails[toNail].y,
-            resolution, resolution
-        );
-        
-        for (int idx : pixels) {
-            int y = idx / resolution;
-            int x = idx % resolution;
-            if (x >= 0 && x < resolution && y >= 0 && y < resolution) {
-                intensity[idx] = intensity[idx] * (1.0 - lineAlpha) + lineAlpha;
+    int GetResolution() const { return resolution; }
+    
+    // One byte of brightness per pixel, row-major.
+    void RenderGray(unsigned char* out) const {
+        for (int i = 0; i < resolution * resolution; i++) {
+            out[i] = (unsigned char)(intensity[i] * 255.0);
+        }
+    }
+    
+};
+
+bool WriteGrayPng(const std::string& outputDir, int frameNumber, const unsigned char* gray,
+                  int resolution, std::vector<unsigned char>& rgb) {
+    rgb.resize(resolution * resolution * 3);
+    for (int i = 0; i < resolution * resolution; i++) {
+        rgb[i * 3 + 0] = gray[i];
+        rgb[i * 3 + 1] = gray[i];
+        rgb[i * 3 + 2] = gray[i];
+    }
+    
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s/frame_%06d.png", outputDir.c_str(), frameNumber);
+    return stbi_write_png(filename, resolution, resolution, 3, rgb.data(), resolution * 3) != 0;
+}
+
+// PNG frames encoded off the main thread. The main thread renders each frame
+// into one of a fixed ring of buffers and moves on; worker threads compress
+// and write filled buffers, then hand them back. When every buffer is in
+// flight Publish blocks, which bounds memory. Each frame keeps the number it
+// was published with, so the files are the same whatever order they finish.
+class FrameEncodePipeline {
+private:
+    struct Slot {
+        std::vector<unsigned char> gray;
+        int frameNumber = 0;
+    };
+    
+    std::string outputDir;
+    int resolution;
+    std::vector<Slot> slots;
+    std::deque<int> freeSlots;
+    std::deque<int> readySlots;
+    std::mutex mutex;
+    std::condition_variable slotFreed;
+    std::condition_variable frameReady;
+    bool closing = false;
+    std::vector<std::thread> workers;
+    std::atomic<int> failures{ 0 };
+    
+    void WorkerLoop() {
+        std::vector<unsigned char> rgb;
+        while (true) {
+            int slot;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                frameReady.wait(lock, [&] { return closing || !readySlots.empty(); });
+                if (readySlots.empty()) return;
+                slot = readySlots.front();
+                readySlots.pop_front();
+            }
+            
+            const Slot& frame = slots[slot];
+            if (!WriteGrayPng(outputDir, frame.frameNumber, frame.gray.data(), resolution, rgb)) {
+                std::cerr << "[Frame " << frame.frameNumber << "] FAILED to save" << std::endl;
+                failures++;
             }
+            
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                freeSlots.push_back(slot);
+            }
+            slotFreed.notify_one();
         }
     }
     
-    void SaveFrame(int frameNumber) {
-        std::vector<unsigned char> imgData(resolution * resolution * 3);
+public:
+    FrameEncodePipeline(const std::string& outputDir, int resolution, int workerCount, int ringSize = 0)
+        : outputDir(outputDir), resolution(resolution) {
+        if (workerCount <= 0) workerCount = std::max(1, (int)std::thread::hardware_concurrency());
+        if (ringSize <= 0) ringSize = workerCount * 2;
         
-        for (int y = 0; y < resolution; y++) {
-            for (int x = 0; x < resolution; x++) {
-                double intens = intensity[y * resolution + x];
-                unsigned char brightness = (unsigned char)(intens * 255.0);
-                
-                int idx = (y * resolution + x) * 3;
-                imgData[idx + 0] = brightness;
-                imgData[idx + 1] = brightness;
-                imgData[idx + 2] = brightness;
+        slots.resize(ringSize);
+        for (int i = 0; i < ringSize; i++) {
+            slots[i].gray.resize(resolution * resolution);
+            freeSlots.push_back(i);
+        }
+        for (int i = 0; i < workerCount; i++) {
+            workers.emplace_back(&FrameEncodePipeline::WorkerLoop, this);
+        }
+    }
+    
+    ~FrameEncodePipeline() {
+        Finish();
+    }
+    
+    void Publish(const VideoFrameGenerator& generator, int frameNumber) {
+        int slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            slotFreed.wait(lock, [&] { return !freeSlots.empty(); });
+            slot = freeSlots.front();
+            freeSlots.pop_front();
+        }
+        
+        generator.RenderGray(slots[slot].gray.data());
+        slots[slot].frameNumber = frameNumber;
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            readySlots.push_back(slot);
+        }
+        frameReady.notify_one();
+    }
+    
+    // Drains the queue and joins the workers. Returns the number of frames
+    // that failed to save.
+    int Finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        frameReady.notify_all();
+        for (auto& w : workers) w.join();
+        workers.clear();
+        return failures;
+    }
+};
+
+// Renders PNG frames for whole segments of the sequence in parallel. A
+// pixel's intensity depends only on how many lines hit it, and with what
+// alphas, so one cheap sequential pass that just tracks a uint16 state per
+// pixel (the hit count, when all lines share an alpha) yields a checkpoint
+// at the start of every segment, and each thread then replays its own
+// segment from there. Intensities come from the same recurrence
+// ApplyLineWithAlpha uses, so the frames are identical to a sequential
+// replay.
+class SegmentRenderer {
+private:
+    const LinePalette* palette;
+    double lineAlpha;
+    std::string outputDir;
+    int resolution;
+    
+public:
+    SegmentRenderer(const LinePalette* palette, double lineAlpha, const std::string& outputDir)
+        : palette(palette), lineAlpha(lineAlpha), outputDir(outputDir), resolution(palette->GetWidth()) {}
+    
+    // Writes every frame, including the final one, and returns the frame
+    // count. sequence is the exported nail path: line i runs from
+    // sequence[i] to sequence[i + 1] with lineAlphas[i], or with the
+    // renderer's alpha when lineAlphas is empty. Failed writes are added to
+    // failures.
+    int Render(const std::vector<int>& sequence, const std::vector<double>& lineAlphas,
+               int frameSkip, int threads, int& failures) {
+        int totalLines = std::max(0, (int)sequence.size() - 1);
+        int pixelCount = resolution * resolution;
+        ThreadPool pool(threads);
+        
+        int segmentCount = std::max(1, std::min(totalLines, pool.GetThreadCount() * 2));
+        int segmentLength = (totalLines + segmentCount - 1) / segmentCount;
+        
+        std::vector<double> alphas;
+        std::vector<int> alphaIndex(totalLines);
+        for (int lineIdx = 0; lineIdx < totalLines; lineIdx++) {
+            double alpha = lineAlphas.empty() ? lineAlpha : lineAlphas[lineIdx];
+            auto it = std::find(alphas.begin(), alphas.end(), alpha);
+            alphaIndex[lineIdx] = (int)(it - alphas.begin());
+            if (it == alphas.end()) alphas.push_back(alpha);
+        }
+        int alphaCount = std::max(1, (int)alphas.size());
+        
+        // A state indexes levels; next[state * alphaCount + a] is the state
+        // after one more line with alphas[a], created on first use. States
+        // saturate at UINT16_MAX like the hit counts they replace.
+        std::vector<double> levels{ 0.0 };
+        std::vector<int> next(alphaCount, -1);
+        
+        std::vector<std::vector<std::uint16_t>> checkpoints(segmentCount);
+        std::vector<std::uint16_t> hits(pixelCount, 0);
+        LineScratch scratch;
+        for (int seg = 0; seg < segmentCount; seg++) {
+            checkpoints[seg] = hits;
+            int end = std::min(totalLines, (seg + 1) * segmentLength);
+            for (int lineIdx = seg * segmentLength; lineIdx < end; lineIdx++) {
+                int a = alphaIndex[lineIdx];
+                for (int idx : palette->GetLine(sequence[lineIdx], sequence[lineIdx + 1], scratch)) {
+                    int slot = hits[idx] * alphaCount + a;
+                    if (next[slot] < 0 && levels.size() <= UINT16_MAX) {
+                        next[slot] = (int)levels.size();
+                        levels.push_back(levels[hits[idx]] * (1.0 - alphas[a]) + alphas[a]);
+                        next.resize(next.size() + alphaCount, -1);
+                    }
+                    if (next[slot] >= 0) hits[idx] = (std::uint16_t)next[slot];
+                }
             }
         }
         
-        char filename[256];
-        snprintf(filename, sizeof(filename), "%s/frame_%06d.png", outputDir.c_str(), frameNumber);
+        std::vector<unsigned char> grayLevels(levels.size());
+        for (size_t k = 0; k < levels.size(); k++) grayLevels[k] = (unsigned char)(levels[k] * 255.0);
+        
+        std::atomic<int> failed{ 0 };
+        std::atomic<int> segmentsDone{ 0 };
+        std::mutex logMutex;
+        auto writeFrame = [&](const std::vector<std::uint16_t>& state, int frameNumber,
+                              std::vector<unsigned char>& gray, std::vector<unsigned char>& rgb) {
+            for (int i = 0; i < pixelCount; i++) gray[i] = grayLevels[state[i]];
+            if (!WriteGrayPng(outputDir, frameNumber, gray.data(), resolution, rgb)) failed++;
+        };
         
-        if (!stbi_write_png(filename, resolution, resolution, 3, imgData.data(), resolution * 3)) {
-            std::cerr << "[Frame " << frameNumber << "] FAILED to save" << std::endl;
+        pool.ParallelForEach(segmentCount, [&](int seg, int) {
+            std::vector<std::uint16_t> local = std::move(checkpoints[seg]);
+            LineScratch lineScratch;
+            std::vector<unsigned char> gray(pixelCount), rgb;
+            
+            int end = std::min(totalLines, (seg + 1) * segmentLength);
+            for (int lineIdx = seg * segmentLength; lineIdx < end; lineIdx++) {
+                int a = alphaIndex[lineIdx];
+                for (int idx : palette->GetLine(sequence[lineIdx], sequence[lineIdx + 1], lineScratch)) {
+                    int state = next[local[idx] * alphaCount + a];
+                    if (state >= 0) local[idx] = (std::uint16_t)state;
+                }
+                if ((lineIdx + 1) % frameSkip == 0) {
+                    writeFrame(local, (lineIdx + 1) / frameSkip - 1, gray, rgb);
+                }
+            }
+            
+            int done = ++segmentsDone;
+            std::lock_guard<std::mutex> lock(logMutex);
+            std::cout << "[" << std::setw(3) << done * 100 / segmentCount << "%] segment "
+                      << done << " / " << segmentCount << " rendered" << std::endl;
+        });
+        
+        int frameCount = totalLines / frameSkip;
+        std::vector<unsigned char> gray(pixelCount), rgb;
+        writeFrame(hits, frameCount, gray, rgb);
+        
+        failures += failed;
+        return frameCount + 1;
+    }
+};
+
+// Raw grayscale frames as a YUV4MPEG2 stream (Cmono), written either to a
+// file or to an encoder's stdin, so no per-frame files are compressed and
+// decoded again.
+class Y4mStream {
+private:
+    FILE* out = nullptr;
+    bool isPipe = false;
+    int frameBytes = 0;
+    
+    bool WriteHeader(int width, int height, int fps) {
+        frameBytes = width * height;
+        return fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 Cmono\n", width, height, fps) > 0;
+    }
+    
+public:
+    Y4mStream() = default;
+    Y4mStream(const Y4mStream&) = delete;
+    Y4mStream& operator=(const Y4mStream&) = delete;
+    
+    ~Y4mStream() {
+        Close();
+    }
+    
+    bool OpenFile(const std::string& path, int width, int height, int fps) {
+        out = fopen(path.c_str(), "wb");
+        isPipe = false;
+        return out && WriteHeader(width, height, fps);
+    }
+    
+    bool OpenPipe(const std::string& command, int width, int height, int fps) {
+#if defined(_WIN32)
+        out = _popen(command.c_str(), "wb");
+#else
+        // A missing encoder must surface as a write error, not kill us.
+        signal(SIGPIPE, SIG_IGN);
+        out = popen(command.c_str(), "w");
+#endif
+        isPipe = true;
+        return out && WriteHeader(width, height, fps);
+    }
+    
+    bool WriteFrame(const unsigned char* gray) {
+        if (!out) return false;
+        if (fputs("FRAME\n", out) < 0) return false;
+        return fwrite(gray, 1, frameBytes, out) == (size_t)frameBytes;
+    }
+    
+    // For a pipe, true only if the encoder exited successfully.
+    bool Close() {
+        if (!out) return true;
+        int status;
+        if (isPipe) {
+#if defined(_WIN32)
+            status = _pclose(out);
+#else
+            status = pclose(out);
+#endif
+        } else {
+            status = fclose(out);
         }
+        out = nullptr;
+        return status == 0;
     }
 };
 
@@ -236,6 +588,12 @@ public:
         }
     }
     
+    static std::string PipeCommand(const std::string& outputFile,
+                                   const std::string& ffmpegPath = "ffmpeg") {
+        return "\"" + ffmpegPath + "\" -loglevel error -f yuv4mpegpipe -i - " +
+               "-c:v libx264 -pix_fmt yuv420p -y \"" + outputFile + "\"";
+    }
+    
     static bool DeleteFramesDirectory(const std::string& framesDir) {
         std::cout << "\n========== CLEANUP ==========" << std::endl;
         std::cout << "Deleting temporary frames directory..." << std::endl;
@@ -257,20 +615,38 @@ int main(int argc, char* argv[]) {
     GenerationConfig config;
     
     if (argc < 2) {
-        std::cout << "Usage: video_generator <result.json> [fps] [output_file]" << std::endl;
+        std::cout << "Usage: video_generator <result.json> [fps] [output_file] [png|segments|y4m|pipe]" << std::endl;
+        std::cout << "  png      - PNG frames in " << config.outputDir << ", then ffmpeg (default)" << std::endl;
+        std::cout << "  segments - like png, with sequence segments rendered in parallel" << std::endl;
+        std::cout << "  y4m      - raw YUV4MPEG2 stream written to output_file" << std::endl;
+        std::cout << "  pipe     - raw stream piped straight into ffmpeg" << std::endl;
         std::cout << "Examples:" << std::endl;
         std::cout << "  video_generator result.json" << std::endl;
         std::cout << "  video_generator result.json 60 output.mp4" << std::endl;
+        std::cout << "  video_generator result.json 60 output.y4m y4m" << std::endl;
         return 1;
     }
     
     config.jsonPath = argv[1];
     if (argc > 2) config.fps = std::atoi(argv[2]);
     
-    std::string outputFile = "output.mp4";
+    if (argc > 4) {
+        std::string mode = argv[4];
+        if (mode == "segments") config.frameOutput = FrameOutput::PngSegments;
+        else if (mode == "y4m") config.frameOutput = FrameOutput::Y4mFile;
+        else if (mode == "pipe") config.frameOutput = FrameOutput::Y4mPipe;
+        else if (mode != "png") {
+            std::cerr << "ERROR: Unknown output mode: " << mode << std::endl;
+            return 1;
+        }
+    }
+    
+    bool pngFrames = config.frameOutput == FrameOutput::Png || config.frameOutput == FrameOutput::PngSegments;
+    
+    std::string outputFile = (config.frameOutput == FrameOutput::Y4mFile) ? "output.y4m" : "output.mp4";
     if (argc > 3) outputFile = argv[3];
     
-    if (!fs::exists(config.outputDir)) {
+    if (pngFrames && !fs::exists(config.outputDir)) {
         fs::create_directories(config.outputDir);
         std::cout << "✓ Created output directory: " << config.outputDir << std::endl;
     }
@@ -280,43 +656,94 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
-    std::vector<Nail> nails = GenerateNails(
-        loader.nailCount,
-        config.imageResolution / 2.0,
-        config.imageResolution / 2.0,
-        config.imageResolution / 2.0 - 5
-    );
+    if (loader.nailCount < 2) {
+        std::cerr << "ERROR: JSON has no usable nail_count" << std::endl;
+        return 1;
+    }
+    
+    // Same palette (and on-disk cache) as the optimizer, so replaying a line
+    // is a lookup instead of a rasterization.
+    LinePalette palette(loader.nailCount, config.imageResolution, config.imageResolution,
+                        config.paletteCacheDirectory);
+    std::cout << "✓ Line palette " << (palette.IsLoadedFromCache() ? "mapped from " : "built into ")
+              << config.paletteCacheDirectory << std::endl;
     
     std::cout << "\n========== GENERATING FRAMES ==========" << std::endl;
     
-    VideoFrameGenerator generator(config.imageResolution, config.lineAlpha, config.outputDir);
-    generator.SetNails(nails);
+    VideoFrameGenerator generator(&palette, config.lineAlpha, config.outputDir);
+    
+    Y4mStream stream;
+    std::vector<unsigned char> gray;
+    if (!pngFrames) {
+        int res = generator.GetResolution();
+        bool opened = (config.frameOutput == FrameOutput::Y4mFile)
+            ? stream.OpenFile(outputFile, res, res, config.fps)
+            : stream.OpenPipe(VideoConverter::PipeCommand(outputFile, config.ffmpegPath), res, res, config.fps);
+        if (!opened) {
+            std::cerr << "ERROR: Cannot open Y4M output: " << outputFile << std::endl;
+            return 1;
+        }
+        gray.resize(res * res);
+    }
+    
+    std::unique_ptr<FrameEncodePipeline> encoder;
+    if (config.frameOutput == FrameOutput::Png) {
+        encoder = std::make_unique<FrameEncodePipeline>(config.outputDir, generator.GetResolution(),
+                                                        config.encodeThreads);
+    }
+    
+    bool streamOk = true;
+    auto emitFrame = [&](int frameNumber) {
+        if (encoder) {
+            encoder->Publish(generator, frameNumber);
+        } else if (streamOk) {
+            generator.RenderGray(gray.data());
+            streamOk = stream.WriteFrame(gray.data());
+        }
+    };
     
     auto startTime = std::chrono::high_resolution_clock::now();
     
     int frameCount = 0;
-    int totalThreads = loader.threadSequence.size() / 2;
+    // thread_sequence is a nail path: the first nail, then the end nail of
+    // every line.
+    int totalThreads = std::max(0, (int)loader.threadSequence.size() - 1);
     
-    for (int lineIdx = 0; lineIdx < totalThreads; lineIdx++) {
-        int fromNail = loader.threadSequence[lineIdx * 2];
-        int toNail = loader.threadSequence[lineIdx * 2 + 1];
-        
-        generator.ApplyLineWithAlpha(fromNail, toNail);
-        
-        if ((lineIdx + 1) % config.frameSkip == 0) {
-            generator.SaveFrame(frameCount);
-            frameCount++;
+    if (config.frameOutput == FrameOutput::PngSegments) {
+        int failed = 0;
+        SegmentRenderer renderer(&palette, config.lineAlpha, config.outputDir);
+        frameCount = renderer.Render(loader.threadSequence, loader.lineAlphas, config.frameSkip, config.encodeThreads, failed);
+        if (failed > 0) std::cerr << "WARNING: " << failed << " frames failed to save" << std::endl;
+    } else {
+        for (int lineIdx = 0; lineIdx < totalThreads; lineIdx++) {
+            int fromNail = loader.threadSequence[lineIdx];
+            int toNail = loader.threadSequence[lineIdx + 1];
             
-            if ((lineIdx + 1) % (config.frameSkip * 50) == 0) {
-                int percent = (int)((lineIdx + 1) / (double)totalThreads * 100);
-                std::cout << "[" << std::setw(3) << percent << "%] "
-                          << (lineIdx + 1) << " / " << totalThreads << " lines" << std::endl;
+            if (loader.lineAlphas.empty()) generator.ApplyLineWithAlpha(fromNail, toNail);
+            else generator.ApplyLineWithAlpha(fromNail, toNail, loader.lineAlphas[lineIdx]);
+            
+            if ((lineIdx + 1) % config.frameSkip == 0) {
+                emitFrame(frameCount);
+                frameCount++;
+                
+                if ((lineIdx + 1) % (config.frameSkip * 50) == 0) {
+                    int percent = (int)((lineIdx + 1) / (double)totalThreads * 100);
+                    std::cout << "[" << std::setw(3) << percent << "%] "
+                              << (lineIdx + 1) << " / " << totalThreads << " lines" << std::endl;
+                }
             }
         }
+        
+        emitFrame(frameCount);
+        frameCount++;
     }
     
-    generator.SaveFrame(frameCount);
-    frameCount++;
+    if (encoder) {
+        int failed = encoder->Finish();
+        if (failed > 0) std::cerr << "WARNING: " << failed << " frames failed to save" << std::endl;
+    } else if (!pngFrames) {
+        streamOk = stream.Close() && streamOk;
+    }
     
     auto endTime = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
@@ -325,6 +752,22 @@ int main(int argc, char* argv[]) {
     std::cout << "Total frames generated: " << frameCount << std::endl;
     std::cout << "Total processing time: " << duration.count() << "ms" << std::endl;
     
+    if (!pngFrames) {
+        if (!streamOk) {
+            std::cerr << "\n========== ERROR ==========" << std::endl;
+            std::cerr << (config.frameOutput == FrameOutput::Y4mPipe
+                              ? "Encoder failed or is not installed: " + config.ffmpegPath
+                              : "Failed to write: " + outputFile) << std::endl;
+            return 1;
+        }
+        
+        std::cout << "\n========== SUCCESS ==========" << std::endl;
+        std::cout << (config.frameOutput == FrameOutput::Y4mPipe ? "✓ Video ready: " : "✓ Y4M stream ready: ")
+                  << outputFile << std::endl;
+        std::cout << "✓ FPS: " << config.fps << std::endl;
+        return 0;
+    }
+    
     bool videoCreated = VideoConverter::CreateVideoFromFrames(config.outputDir, outputFile, config.fps, config.ffmpegPath);
     
     if (videoCreated) {